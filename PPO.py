@@ -1,10 +1,15 @@
+import argparse
+import os
 import numpy as np
 import random
 from ctypes import *
 from py_interface import *
+from pbt import PbtMember, agent_tag
 
 
-class Env(Structure):
+MAX_AP_SLOTS = 8  # jeden slot polityki na AP, jak w ftm-agent-protocol.h
+
+class ApEnv(Structure):
     _pack_ = 1
     _fields_ = [
         ('ftmNumberOfBurstsExponent', c_uint8),
@@ -19,9 +24,20 @@ class Env(Structure):
         ('successes', c_uint32),
         ('nWifi', c_uint32),
         ('dataRate', c_uint32),
+        ('loadBucket', c_uint8),
+        ('powerState', c_uint8),
+        ('distanceBucket', c_uint8),
+        ('context', c_uint16),
     ]
 
-class Act(Structure):
+class Env(Structure):
+    _pack_ = 1
+    _fields_ = [
+        ('nAp', c_uint32),
+        ('ap', ApEnv * MAX_AP_SLOTS),
+    ]
+
+class ApAct(Structure):
     _pack_ = 1
     _fields_ = [
         ('ftmNumberOfBurstsExponent', c_uint8),
@@ -35,6 +51,13 @@ class Act(Structure):
         ('apply', c_bool),
     ]
 
+class Act(Structure):
+    _pack_ = 1
+    _fields_ = [
+        ('ap', ApAct * MAX_AP_SLOTS),
+        ('changeEvery', c_uint32),  # 0 = bez zmiany długości segmentu
+    ]
+
 
 
 import tensorflow as tf
@@ -48,7 +71,7 @@ PERIOD_ARMS = list(range(1, 16))
 ASAP_ARMS = [False, True]
 NUM_CLASSES = [len(BDUR_ARMS), len(MINDELTA), len(FTMS_ARMS), len(PERIOD_ARMS), len(ASAP_ARMS)]
 
-def build_state(e: Env):
+def build_state(e: ApEnv):
     sr = (e.successes / e.attempts) if e.attempts else 0.0
     n = float(e.nWifi) / 50.0
     dr = float(e.dataRate) / 100.0
@@ -127,8 +150,9 @@ class RolloutBuffer:
 class PPOAgentKeras:
     def __init__(self, state_dim=3, lr=3e-4, gamma=0.99, clip_eps=0.2, ent_coef=0.01, vf_coef=0.5, epochs=4):
         self.gamma  = gamma
-        self.clip_eps = clip_eps
-        self.ent_coef = ent_coef
+        # zmienne, a nie stałe wkompilowane w tf.function - PBT zmienia je w trakcie
+        self.clip_eps = tf.Variable(clip_eps, trainable=False, dtype=tf.float32)
+        self.ent_coef = tf.Variable(ent_coef, trainable=False, dtype=tf.float32)
         self.vf_coef = vf_coef
         self.epochs = epochs
         self.net = PolicyValueNet(state_dim=state_dim)
@@ -138,18 +162,15 @@ class PPOAgentKeras:
     def _forward(self, states):
         return self.net(states, training=False)
 
-    def select_action(self, state_vec):
-        s = tf.convert_to_tensor(state_vec[None, :], dtype=tf.float32)
+    def select_actions(self, states):
+        # jeden przebieg sieci dla stanów wszystkich AP: states (N,3)
+        s = tf.convert_to_tensor(states, dtype=tf.float32)
         logits_list, v = self._forward(s)
-        actions = []
-        for logits in logits_list:
-            sample = tf.random.categorical(logits, num_samples=1)  # (1,1)
-            a = int(sample[0, 0].numpy())
-            actions.append(a)
-        # policz łączny logP wybranej akcji
-        A_tensor = tf.convert_to_tensor(np.array(actions, dtype=np.int64)[None, :])
-        logp, _  = logprob_and_entropy([l for l in logits_list], A_tensor)
-        return actions, float(v.numpy()[0]), float(logp.numpy()[0])
+        samples = [tf.random.categorical(logits, num_samples=1)[:, 0] for logits in logits_list]
+        A_tensor = tf.stack(samples, axis=1)  # (N,5)
+        # policz łączny logP wybranych akcji
+        logp, _  = logprob_and_entropy(logits_list, A_tensor)
+        return A_tensor.numpy().tolist(), v.numpy().tolist(), logp.numpy().tolist()
 
     @tf.function
     def _train_step(self, S, A, LP_old, V_old, RET, ADV):
@@ -179,7 +200,21 @@ class PPOAgentKeras:
             self._train_step(S, A, LP_old, V_old, RET, ADV)
         buffer.clear()
 
-def fill_act_from_indices(a: Act, idxs):
+    def set_hparams(self, lr, clip_eps, ent_coef):
+        self.opt.learning_rate.assign(lr)
+        self.clip_eps.assign(clip_eps)
+        self.ent_coef.assign(ent_coef)
+
+    def save(self, path):
+        np.savez(path, *self.net.get_weights())
+
+    def load(self, path):
+        # sieć musi być zbudowana przed set_weights
+        self.net(tf.zeros((1, 3)))
+        data = np.load(path)
+        self.net.set_weights([data[f'arr_{i}'] for i in range(len(data.files))])
+
+def fill_act_from_indices(a: ApAct, idxs):
     i_bdur, i_mind, i_ftms, i_period, i_asap = idxs
     a.ftmNumberOfBurstsExponent = 1
     a.ftmBurstDuration = BDUR_ARMS[i_bdur]
@@ -193,63 +228,115 @@ def fill_act_from_indices(a: Act, idxs):
 
 
 def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--mempoolKey', type=int, default=1235)
+    parser.add_argument('--memblockKey', type=int, default=2334)
+    parser.add_argument('--lr', type=float, default=3e-4)
+    parser.add_argument('--clipEps', type=float, default=0.2)
+    parser.add_argument('--entCoef', type=float, default=0.01)
+    parser.add_argument('--batchSeg', type=int, default=64, help='co tyle segmentów robimy update')
+    parser.add_argument('--changeEvery', type=int, default=10, help='sesje FTM na AP w segmencie')
+    parser.add_argument('--program', default='scenario', help='program ns-3, np. agent-bench')
+    parser.add_argument('--workdir', default=None, help='katalog członka populacji (pbt.py)')
+    parser.add_argument('--set', action='append', default=[], metavar='NAME=VALUE',
+                        help='dodatkowy argument scenario')
+    args = parser.parse_args()
+
     random.seed(0)
     np.random.seed(0)
     tf.random.set_seed(0)
 
-    mempool_key = 1235
+    mempool_key = args.mempoolKey
     mem_size = 4096
-    memblock_key = 2334
+    memblock_key = args.memblockKey
     ns3_path = '.'
-    exp_name = 'scenario'
+    exp_name = args.program
+
+    hp = dict(lr=args.lr, clipEps=args.clipEps, entCoef=args.entCoef,
+              batchSeg=args.batchSeg, changeEvery=args.changeEvery)
+
+    member = None
+    if args.workdir:
+        member = PbtMember(args.workdir, hp)
+        hp = member.hparams
 
-    agent = PPOAgentKeras(state_dim=3, lr=3e-4, gamma=0.99, clip_eps=0.2, ent_coef=0.01, vf_coef=0.5, epochs=4)
+    agent = PPOAgentKeras(state_dim=3, lr=hp['lr'], gamma=0.99, clip_eps=hp['clipEps'],
+                          ent_coef=hp['entCoef'], vf_coef=0.5, epochs=4)
     buffer = RolloutBuffer()
-    BATCH_SEG = 64  # co tyle segmentów robimy update
+
+    if member is not None and os.path.exists(member.checkpoint_path):
+        agent.load(member.checkpoint_path)
+
+    setting = dict(kv.split('=', 1) for kv in args.set)
+    setting.update(memblockKey=memblock_key, changeEvery=hp['changeEvery'],
+                   SharedMemoryKey=mempool_key, SharedMemoryPoolSize=mem_size)
+    if args.program == 'scenario':
+        # wyniki z cache tylko dla tego samego agenta w tym samym stanie
+        setting.update(agentTag=agent_tag('ppo', hp, member.checkpoint_path if member else None))
 
     exp = Experiment(mempool_key, mem_size, exp_name, ns3_path)
 
-    last = None  
+    last = {}  # poprzednia akcja każdego AP
 
     try:
         exp.reset()
         rl  = Ns3AIRL(memblock_key, Env, Act)
-        pro = exp.run(setting={}, show_output=True)
+        pro = exp.run(setting=setting, show_output=True)
 
         while not rl.isFinish():
             with rl as data:
                 if data is None:
                     continue
 
-                # Stan z feedbacku poprzedniej akcji:
-                e = data.env
-                s_now = build_state(e)
+                # Stan z feedbacku poprzedniej akcji, dla wszystkich AP naraz:
+                n_ap = data.env.nAp
+                s_now = np.stack([build_state(data.env.ap[k]) for k in range(n_ap)])
+
+                # Wybierz nowe akcje (V(s_now) jest też V(next) poprzednich przejść)
+                a_idx, v_now, logp_now = agent.select_actions(s_now)
 
-                # Jeśli mamy poprzednią akcję -> zapis przejścia z nagrodą
-                if last is not None:
-                    attempts, successes = e.attempts, e.successes
-                    r = (successes / attempts) if attempts > 0 else 0.0
-                    # V(next)
-                    logits_list, v_next_tf = agent._forward(tf.convert_to_tensor(s_now[None, :], dtype=tf.float32))
-                    v_next = float(v_next_tf.numpy()[0])
-                    buffer.add(last['s'], last['a_idx'], last['logp'], last['v'], r, v_next)
-                    print(f"PY recv: attempts={attempts} succ={successes} rate={r:.3f}")
+                for k in range(n_ap):
+                    e = data.env.ap[k]
 
-                # Wybierz nową akcję i wyślij do C++
-                a_idx, v_now, logp_now = agent.select_action(s_now)
-                a = data.act
-                fill_act_from_indices(a, a_idx)
+                    # Jeśli mamy poprzednią akcję -> zapis przejścia z nagrodą
+                    if k in last:
+                        attempts, successes = e.attempts, e.successes
+                        r = (successes / attempts) if attempts > 0 else 0.0
+                        buffer.add(last[k]['s'], last[k]['a_idx'], last[k]['logp'], last[k]['v'], r, v_now[k])
+                        print(f"PY recv AP{k}: attempts={attempts} succ={successes} rate={r:.3f}")
 
-                print("PY sent PPO:",
-                      BDUR_ARMS[a_idx[0]], MINDELTA[a_idx[1]], FTMS_ARMS[a_idx[2]],
-                      PERIOD_ARMS[a_idx[3]], ASAP_ARMS[a_idx[4]])
+                    # Wyślij akcję do C++
+                    a = data.act.ap[k]
+                    fill_act_from_indices(a, a_idx[k])
 
-                last = dict(s=s_now, a_idx=a_idx, logp=logp_now, v=v_now)
+                    print(f"PY sent PPO AP{k}:",
+                          BDUR_ARMS[a_idx[k][0]], MINDELTA[a_idx[k][1]], FTMS_ARMS[a_idx[k][2]],
+                          PERIOD_ARMS[a_idx[k][3]], ASAP_ARMS[a_idx[k][4]])
+
+                    last[k] = dict(s=s_now[k], a_idx=a_idx[k], logp=logp_now[k], v=v_now[k])
+
+                # długość segmentu tylko po zmianie przez PBT, 0 nie nadpisuje
+                # wartości z argumentów scenario ani z gniazda sterującego
+                data.act.changeEvery = 0
 
                 # Aktualizacja co batch
-                if len(buffer) >= BATCH_SEG:
+                if len(buffer) >= hp['batchSeg']:
                     agent.update(buffer)
 
+                if member is not None:
+                    aps = [data.env.ap[k] for k in range(n_ap)]
+                    member.record(sum(e.attempts for e in aps), sum(e.successes for e in aps))
+                    member.checkpoint(agent.save)
+                    control = member.poll()
+                    if control is not None:
+                        # przejęcie wag lepszego członka; stary bufor pochodzi z innej polityki
+                        agent.load(control['checkpoint'])
+                        agent.set_hparams(hp['lr'], hp['clipEps'], hp['entCoef'])
+                        buffer.clear()
+                        last.clear()
+                        data.act.changeEvery = hp['changeEvery']
+                        print(f"PY PBT: exploit {control['checkpoint']} {hp}")
+
         # po epizodzie – ostatni update (jeśli coś w buforze)
         if len(buffer) > 0:
             agent.update(buffer)
@@ -1,8 +1,14 @@
-import random
+import argparse
+import os
+import numpy as np
 from ctypes import *
 from py_interface import *
+from pbt import PbtMember, agent_tag
 
-class Env(Structure):
+MAX_AP_SLOTS = 8  # jeden slot polityki na AP, jak w ftm-agent-protocol.h
+N_CONTEXTS = 4 * 3 * 4  # obciążenie x moc x odległość, jak w ftm-agent-protocol.h
+
+class ApEnv(Structure):
     _pack_ = 1
     _fields_ = [
         ('ftmNumberOfBurstsExponent', c_uint8),
@@ -17,9 +23,20 @@ class Env(Structure):
         ('successes', c_uint32),
         ('nWifi', c_uint32),
         ('dataRate', c_uint32),
+        ('loadBucket', c_uint8),
+        ('powerState', c_uint8),
+        ('distanceBucket', c_uint8),
+        ('context', c_uint16),
     ]
 
-class Act(Structure):
+class Env(Structure):
+    _pack_ = 1
+    _fields_ = [
+        ('nAp', c_uint32),
+        ('ap', ApEnv * MAX_AP_SLOTS),
+    ]
+
+class ApAct(Structure):
     _pack_ = 1
     _fields_ = [
         ('ftmNumberOfBurstsExponent', c_uint8),
@@ -33,52 +50,65 @@ class Act(Structure):
         ('apply', c_bool),
     ]
 
+class Act(Structure):
+    _pack_ = 1
+    _fields_ = [
+        ('ap', ApAct * MAX_AP_SLOTS),
+        ('changeEvery', c_uint32),  # 0 = bez zmiany długości segmentu
+    ]
 
-class BetaBernoulliTS:
-    def __init__(self, arms):
-        self.arms = list(arms)                 
-        self.alpha = {a: 1.0 for a in self.arms}
-        self.beta  = {a: 1.0 for a in self.arms}
-        self.prev_arm = None                   
 
-    def update_from_segment(self, attempts, successes):
-        if self.prev_arm is None:
+PARAM_ARMS = {
+    "ftmBurstDuration": list(range(1, 11)),
+    "ftmMinDeltaFtm": list(range(1, 11)),
+    "ftmAsap": [False, True],
+    "ftmFtmsPerBurst": list(range(1, 11)),
+    "ftmBurstPeriod": list(range(1, 16)),
+}
+
+
+class ContextualBetaTS:
+    """Rozkłady Beta dla każdej pary (kontekst, ramię).
+
+    Ramiona wszystkich parametrów leżą obok siebie w płaskich tablicach
+    alpha/beta o kształcie (N_CONTEXTS, liczba ramion), więc losowanie
+    wszystkich ramion w danym kontekście to jedno wywołanie np.random.beta.
+    """
+    def __init__(self, param_arms, n_contexts):
+        self.names = list(param_arms)
+        self.arms = [list(param_arms[n]) for n in self.names]
+        self.offsets = np.cumsum([0] + [len(a) for a in self.arms])
+        self.alpha = np.ones((n_contexts, self.offsets[-1]))
+        self.beta  = np.ones((n_contexts, self.offsets[-1]))
+        self.prev_idx = None  # płaskie indeksy ramion wybranych ostatnio
+
+    def update_from_segment(self, context, attempts, successes):
+        # segment zaliczamy ramionom, które w nim grały, w kontekście z tego segmentu
+        if self.prev_idx is None:
             return
         if attempts is None or attempts == 0:
             return
         successes = min(successes, attempts)
         failures = attempts - successes
-        self.alpha[self.prev_arm] += successes
-        self.beta[self.prev_arm]  += failures
-
-    def select_arm(self):
-        best_arm = None
-        best_draw = -1.0
-        for a in self.arms:
-            draw = random.betavariate(self.alpha[a], self.beta[a])
-            if draw > best_draw:
-                best_draw = draw
-                best_arm = a
-        self.prev_arm = best_arm
-        return best_arm
-
-
-def ftm_success_rate(e: Env):
+        self.alpha[context, self.prev_idx] += successes
+        self.beta[context, self.prev_idx]  += failures
+
+    def select_arms(self, context):
+        draws = np.random.beta(self.alpha[context], self.beta[context])
+        bounds = zip(self.offsets[:-1], self.offsets[1:])
+        self.prev_idx = np.array([lo + int(np.argmax(draws[lo:hi])) for lo, hi in bounds])
+        return {name: arms[i - lo] for name, arms, i, lo
+                in zip(self.names, self.arms, self.prev_idx, self.offsets[:-1])}
+
+
+def ftm_success_rate(e: ApEnv):
     return (e.successes / e.attempts) if e.attempts else None
 
-def update_all_samplers_from_env(e: Env):
-    attempts, successes = e.attempts, e.successes
-    for s in SAMPLERS.values():
-        s.update_from_segment(attempts, successes)
-
-def set_params_with_ts(a: Act):
-    chosen = {
-        "ftmBurstDuration": SAMPLERS["ftmBurstDuration"].select_arm(),
-        "ftmMinDeltaFtm": SAMPLERS["ftmMinDeltaFtm"].select_arm(),
-        "ftmAsap": SAMPLERS["ftmAsap"].select_arm(),
-        "ftmFtmsPerBurst": SAMPLERS["ftmFtmsPerBurst"].select_arm(),
-        "ftmBurstPeriod": SAMPLERS["ftmBurstPeriod"].select_arm(),
-    }
+def set_params_with_ts(sampler, e: ApEnv, a: ApAct):
+    sampler.update_from_segment(e.context, e.attempts, e.successes)
+    # kontekst ostatniego segmentu przewiduje warunki w następnym
+    chosen = sampler.select_arms(e.context)
+
     a.ftmNumberOfBurstsExponent = 1
     a.ftmBurstDuration = chosen["ftmBurstDuration"]
     a.ftmMinDeltaFtm = chosen["ftmMinDeltaFtm"]
@@ -93,56 +123,109 @@ def set_params_with_ts(a: Act):
 
 
 
-SAMPLERS = {
-    "ftmBurstDuration": BetaBernoulliTS(arms=range(1, 11)),   
-    "ftmMinDeltaFtm": BetaBernoulliTS(arms=range(1, 11)),   
-    "ftmAsap": BetaBernoulliTS(arms=[False, True]),  
-    "ftmFtmsPerBurst": BetaBernoulliTS(arms=range(1, 11)),   
-    "ftmBurstPeriod": BetaBernoulliTS(arms=range(1, 16)),   
-}
-
-
-
-mempool_key  = 1234
-mem_size     = 4096
-memblock_key = 2333
-ns3_path     = '.'
-exp_name     = 'scenario'
-
-exp = Experiment(mempool_key, mem_size, exp_name, ns3_path)
-
-try:
-    exp.reset()
-    rl = Ns3AIRL(memblock_key, Env, Act)
-    pro = exp.run(setting={}, show_output=True)
-
-    while not rl.isFinish():
-        with rl as data:
-            if data is None:
-                continue
-
-            e = data.env
-            sr = ftm_success_rate(e)
-            if sr is None:
-                print("PY recv: attempts=0 (brak SR)")
-            else:
-                print(f"PY recv: attempts={e.attempts} succ={e.successes} rate={sr:.3f}")
-
-            update_all_samplers_from_env(e)
-   
-            a = data.act
-            chosen = set_params_with_ts(a)
-
-            print("PY sent (TS):",
-                chosen["ftmBurstDuration"],
-                chosen["ftmMinDeltaFtm"],
-                chosen["ftmFtmsPerBurst"],
-                chosen["ftmBurstPeriod"],
-                chosen["ftmAsap"])
-    pro.wait()
-
-except Exception as ex:
-    print("Something wrong")
-    print(ex)
-finally:
-    del exp
+# osobny próbnik dla każdego AP
+SAMPLERS = [ContextualBetaTS(PARAM_ARMS, N_CONTEXTS) for _ in range(MAX_AP_SLOTS)]
+
+
+def save_samplers(path):
+    np.savez(path,
+             alpha=np.stack([s.alpha for s in SAMPLERS]),
+             beta=np.stack([s.beta for s in SAMPLERS]))
+
+def load_samplers(path):
+    # prev_idx zostaje - w symulacji wciąż grają ramiona wybrane przez ten proces
+    data = np.load(path)
+    for k, s in enumerate(SAMPLERS):
+        s.alpha = data['alpha'][k].copy()
+        s.beta = data['beta'][k].copy()
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--mempoolKey', type=int, default=1234)
+    parser.add_argument('--memblockKey', type=int, default=2333)
+    parser.add_argument('--changeEvery', type=int, default=10, help='sesje FTM na AP w segmencie')
+    parser.add_argument('--program', default='scenario', help='program ns-3, np. agent-bench')
+    parser.add_argument('--workdir', default=None, help='katalog członka populacji (pbt.py)')
+    parser.add_argument('--set', action='append', default=[], metavar='NAME=VALUE',
+                        help='dodatkowy argument scenario')
+    args = parser.parse_args()
+
+    mempool_key  = args.mempoolKey
+    mem_size     = 4096
+    memblock_key = args.memblockKey
+    ns3_path     = '.'
+    exp_name     = args.program
+
+    member = None
+    change_every = args.changeEvery
+    if args.workdir:
+        member = PbtMember(args.workdir, {'changeEvery': change_every})
+        change_every = member.hparams['changeEvery']
+        if os.path.exists(member.checkpoint_path):
+            load_samplers(member.checkpoint_path)
+
+    setting = dict(kv.split('=', 1) for kv in args.set)
+    setting.update(memblockKey=memblock_key, changeEvery=change_every,
+                   SharedMemoryKey=mempool_key, SharedMemoryPoolSize=mem_size)
+    if args.program == 'scenario':
+        # wyniki z cache tylko dla tego samego agenta w tym samym stanie
+        setting.update(agentTag=agent_tag('ts', {'changeEvery': change_every},
+                                          member.checkpoint_path if member else None))
+
+    exp = Experiment(mempool_key, mem_size, exp_name, ns3_path)
+
+    try:
+        exp.reset()
+        rl = Ns3AIRL(memblock_key, Env, Act)
+        pro = exp.run(setting=setting, show_output=True)
+
+        while not rl.isFinish():
+            with rl as data:
+                if data is None:
+                    continue
+
+                # wszystkie AP w jednej wymianie
+                for k in range(data.env.nAp):
+                    e = data.env.ap[k]
+                    sr = ftm_success_rate(e)
+                    if sr is None:
+                        print(f"PY recv AP{k}: attempts=0 (brak SR) ctx={e.context}")
+                    else:
+                        print(f"PY recv AP{k}: attempts={e.attempts} succ={e.successes} rate={sr:.3f} ctx={e.context}")
+
+                    a = data.act.ap[k]
+                    chosen = set_params_with_ts(SAMPLERS[k], e, a)
+
+                    print(f"PY sent (TS) AP{k}:",
+                        chosen["ftmBurstDuration"],
+                        chosen["ftmMinDeltaFtm"],
+                        chosen["ftmFtmsPerBurst"],
+                        chosen["ftmBurstPeriod"],
+                        chosen["ftmAsap"])
+
+                # długość segmentu tylko po zmianie przez PBT, 0 nie nadpisuje
+                # wartości z argumentów scenario ani z gniazda sterującego
+                data.act.changeEvery = 0
+
+                if member is not None:
+                    aps = [data.env.ap[k] for k in range(data.env.nAp)]
+                    member.record(sum(e.attempts for e in aps), sum(e.successes for e in aps))
+                    member.checkpoint(save_samplers)
+                    control = member.poll()
+                    if control is not None:
+                        load_samplers(control['checkpoint'])
+                        change_every = member.hparams['changeEvery']
+                        data.act.changeEvery = change_every
+                        print(f"PY PBT: exploit {control['checkpoint']} changeEvery={change_every}")
+        pro.wait()
+
+    except Exception as ex:
+        print("Something wrong")
+        print(ex)
+    finally:
+        del exp
+
+
+if __name__ == "__main__":
+    main()
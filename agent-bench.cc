@@ -0,0 +1,310 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include "ns3/core-module.h"
+#include "ns3/ns3-ai-module.h"
+
+#include "ftm-agent-protocol.h"
+
+using namespace ns3;
+
+NS_LOG_COMPONENT_DEFINE ("ftm-agent-bench");
+
+// Benchmark of agent backends speaking the Env/Act protocol of the scenario,
+// without any network simulation in the loop. Every FTM parameters
+// combination of every AP has a fixed, known success probability, segment
+// results are Bernoulli draws from it. Measures decisions per second, round
+// trip latency of the exchange and regret against the best combination.
+// The success probabilities do not depend on the segment context, so the
+// context fields are always 0: contextual agents learn in context 0 only and
+// the benchmark measures the context-free case.
+
+
+/***** Synthetic success model *****/
+
+// Parameter ranges searched by the agents (ThompsonSampling.py, PPO.py)
+#define N_BURST_DURATION 10
+#define N_MIN_DELTA_FTM 10
+#define N_ASAP 2
+#define N_FTMS_PER_BURST 10
+#define N_BURST_PERIOD 15
+#define N_COMBINATIONS (N_BURST_DURATION * N_MIN_DELTA_FTM * N_ASAP * N_FTMS_PER_BURST * N_BURST_PERIOD)
+
+// Success probability of every combination for one AP: logistic of a bias,
+// one effect per parameter value and a per-combination interaction term
+class SuccessModel
+{
+public:
+  SuccessModel (std::mt19937_64 &rng, double bias, double spread, double interaction);
+
+  double GetProbability (const ApAct &act) const;
+  double GetOptimum (void) const;
+
+private:
+  static int Index (const ApAct &act);
+
+  std::vector<double> m_p;
+  double m_optimum;
+};
+
+SuccessModel::SuccessModel (std::mt19937_64 &rng, double bias, double spread, double interaction)
+{
+  std::normal_distribution<double> normal (0., 1.);
+  std::vector<double> burstDuration (N_BURST_DURATION), minDelta (N_MIN_DELTA_FTM), asap (N_ASAP),
+      ftmsPerBurst (N_FTMS_PER_BURST), burstPeriod (N_BURST_PERIOD);
+
+  for (auto *effects : {&burstDuration, &minDelta, &asap, &ftmsPerBurst, &burstPeriod})
+    {
+      for (double &effect : *effects)
+        {
+          effect = spread * normal (rng);
+        }
+    }
+
+  m_p.resize (N_COMBINATIONS);
+  for (int i = 0; i < N_COMBINATIONS; ++i)
+    {
+      int j = i;
+      double logit = bias + burstPeriod[j % N_BURST_PERIOD];
+      j /= N_BURST_PERIOD;
+      logit += ftmsPerBurst[j % N_FTMS_PER_BURST];
+      j /= N_FTMS_PER_BURST;
+      logit += asap[j % N_ASAP];
+      j /= N_ASAP;
+      logit += minDelta[j % N_MIN_DELTA_FTM];
+      j /= N_MIN_DELTA_FTM;
+      logit += burstDuration[j] + interaction * normal (rng);
+
+      m_p[i] = 1. / (1. + std::exp (-logit));
+    }
+
+  m_optimum = *std::max_element (m_p.begin (), m_p.end ());
+}
+
+int
+SuccessModel::Index (const ApAct &act)
+{
+  // Combinations outside of the searched ranges never succeed
+  if (act.ftmBurstDuration < 1 || act.ftmBurstDuration > N_BURST_DURATION
+      || act.ftmMinDeltaFtm < 1 || act.ftmMinDeltaFtm > N_MIN_DELTA_FTM
+      || act.ftmFtmsPerBurst < 1 || act.ftmFtmsPerBurst > N_FTMS_PER_BURST
+      || act.ftmBurstPeriod < 1 || act.ftmBurstPeriod > N_BURST_PERIOD)
+    {
+      return -1;
+    }
+
+  return (((act.ftmBurstDuration - 1) * N_MIN_DELTA_FTM + act.ftmMinDeltaFtm - 1) * N_ASAP + act.ftmAsap)
+             * N_FTMS_PER_BURST * N_BURST_PERIOD
+         + (act.ftmFtmsPerBurst - 1) * N_BURST_PERIOD + act.ftmBurstPeriod - 1;
+}
+
+double
+SuccessModel::GetProbability (const ApAct &act) const
+{
+  int i = Index (act);
+  return i < 0 ? 0. : m_p[i];
+}
+
+double
+SuccessModel::GetOptimum (void) const
+{
+  return m_optimum;
+}
+
+
+/***** Main with benchmark definition *****/
+
+int
+main (int argc, char *argv[])
+{
+  uint16_t memblockKey = 2333;
+  uint32_t nAp = 1;
+  uint32_t nWifi = 10;
+  uint32_t dataRate = 50;
+  uint32_t decisions = 2000;
+  uint32_t changeEvery = 10;
+  uint32_t modelSeed = 1;
+  uint32_t seed = 1;
+  double bias = 0.;
+  double spread = 1.;
+  double interaction = 0.3;
+  std::string csvPath = "bench.csv";
+
+  CommandLine cmd;
+  cmd.AddValue ("bias", "Logit of the success probability shared by all combinations", bias);
+  cmd.AddValue ("changeEvery", "Number of FTM sessions per AP in one segment", changeEvery);
+  cmd.AddValue ("csvPath", "Path to output CSV file", csvPath);
+  cmd.AddValue ("dataRate", "Offered load reported to the agent (Mb/s)", dataRate);
+  cmd.AddValue ("decisions", "Number of exchanges with the agent", decisions);
+  cmd.AddValue ("interaction", "Standard deviation of the per-combination logit term", interaction);
+  cmd.AddValue ("memblockKey", "Key of the shared memory block used to exchange data with the agent", memblockKey);
+  cmd.AddValue ("modelSeed", "Seed of the success probabilities", modelSeed);
+  cmd.AddValue ("nAp", "Number of APs (policy slots) in every exchange", nAp);
+  cmd.AddValue ("nWifi", "Number of stations per AP reported to the agent", nWifi);
+  cmd.AddValue ("seed", "Seed of the segment results", seed);
+  cmd.AddValue ("spread", "Standard deviation of the per-parameter logit effects", spread);
+  cmd.Parse (argc, argv);
+
+  if (nAp == 0 || nAp > MAX_AP_SLOTS)
+    {
+      std::cerr << "Number of APs must be between 1 and " << MAX_AP_SLOTS << "!";
+      return 3;
+    }
+
+  std::mt19937_64 modelRng (modelSeed);
+  std::mt19937_64 rng (seed);
+  std::vector<SuccessModel> models;
+
+  for (uint32_t k = 0; k < nAp; ++k)
+    {
+      models.push_back (SuccessModel (modelRng, bias, spread, interaction));
+    }
+
+  std::cout << std::endl
+            << "Benchmarking an FTM agent with the following settings:" << std::endl
+            << "- exchanges: " << decisions << std::endl
+            << "- number of APs: " << nAp << std::endl
+            << "- segment length: " << changeEvery << " sessions per AP" << std::endl
+            << "- model: bias=" << bias << " spread=" << spread << " interaction=" << interaction
+            << " seed=" << modelSeed << std::endl;
+
+  for (uint32_t k = 0; k < nAp; ++k)
+    {
+      std::cout << "- AP " << k << " optimum success rate: " << models[k].GetOptimum () << std::endl;
+    }
+
+  std::cout << std::endl;
+
+  static FTMControl ftm (memblockKey);
+
+  // Same defaults as the scenario, the first exchange reports their results
+  ApAct defaultApAct = {1, 6, 4, 0, true, true, 2, 2, true};
+  std::vector<ApAct> params (nAp, defaultApAct);
+
+  std::vector<double> latency;
+  latency.reserve (decisions);
+  double regret = 0.;
+  double lastRegret = 0.; // last 10% of the exchanges
+  uint64_t sessions = 0;
+  uint64_t lastSessions = 0;
+  uint32_t lastStart = decisions - decisions / 10;
+
+  auto start = std::chrono::steady_clock::now ();
+
+  for (uint32_t i = 0; i < decisions; ++i)
+    {
+      // Results of the segment played with the current parameters
+      Env env = {};
+      env.nAp = nAp;
+
+      for (uint32_t k = 0; k < nAp; ++k)
+        {
+          const ApAct &act = params[k];
+          ApEnv &slot = env.ap[k];
+          double p = models[k].GetProbability (act);
+
+          slot.ftmNumberOfBurstsExponent = act.ftmNumberOfBurstsExponent;
+          slot.ftmBurstDuration = act.ftmBurstDuration;
+          slot.ftmMinDeltaFtm = act.ftmMinDeltaFtm;
+          slot.ftmPartialTsfTimer = act.ftmPartialTsfTimer;
+          slot.ftmPartialTsfNoPref = act.ftmPartialTsfNoPref;
+          slot.ftmAsap = act.ftmAsap;
+          slot.ftmFtmsPerBurst = act.ftmFtmsPerBurst;
+          slot.ftmBurstPeriod = act.ftmBurstPeriod;
+          slot.attempts = changeEvery;
+          slot.successes = std::binomial_distribution<uint32_t> (changeEvery, p) (rng);
+          slot.nWifi = nWifi;
+          slot.dataRate = dataRate;
+
+          // Expected successes lost against the best combination
+          double segmentRegret = changeEvery * (models[k].GetOptimum () - p);
+          regret += segmentRegret;
+          sessions += changeEvery;
+
+          if (i >= lastStart)
+            {
+              lastRegret += segmentRegret;
+              lastSessions += changeEvery;
+            }
+        }
+
+      auto exchangeStart = std::chrono::steady_clock::now ();
+      Act result = ftm.GetFTMParams (env);
+      std::chrono::duration<double, std::milli> exchangeTime = std::chrono::steady_clock::now () - exchangeStart;
+      latency.push_back (exchangeTime.count ());
+
+      if (result.changeEvery > 0)
+        {
+          changeEvery = result.changeEvery;
+        }
+
+      for (uint32_t k = 0; k < nAp; ++k)
+        {
+          if (result.ap[k].apply)
+            {
+              params[k] = result.ap[k];
+            }
+        }
+
+      if ((i + 1) % std::max (1u, decisions / 10) == 0)
+        {
+          std::cout << "Exchange " << i + 1 << ": cumulative regret " << regret << " ("
+                    << regret / sessions << " per session)" << std::endl;
+        }
+    }
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now () - start;
+
+  // Latency statistics
+  std::vector<double> sorted = latency;
+  std::sort (sorted.begin (), sorted.end ());
+  double latencySum = 0.;
+  for (double l : sorted)
+    {
+      latencySum += l;
+    }
+
+  double p50 = sorted.empty () ? 0. : sorted[sorted.size () / 2];
+  double p99 = sorted.empty () ? 0. : sorted[std::min (sorted.size () - 1, sorted.size () * 99 / 100)];
+  double decisionsPerSec = decisions * nAp / elapsed.count ();
+  double finalRegret = lastSessions ? lastRegret / lastSessions : 0.;
+
+  std::cout << std::endl
+            << "Results:" << std::endl
+            << "- elapsed time: " << elapsed.count () << " s" << std::endl
+            << "- decisions per second: " << decisionsPerSec << " (" << decisions / elapsed.count ()
+            << " exchanges/s)" << std::endl
+            << "- round trip latency: mean " << (sorted.empty () ? 0. : latencySum / sorted.size ())
+            << " ms, p50 " << p50 << " ms, p99 " << p99 << " ms, max "
+            << (sorted.empty () ? 0. : sorted.back ()) << " ms" << std::endl
+            << "- cumulative regret: " << regret << " successes (" << regret / sessions << " per session)"
+            << std::endl
+            << "- regret per session in the last 10% of exchanges: " << finalRegret << std::endl;
+
+  for (uint32_t k = 0; k < nAp; ++k)
+    {
+      std::cout << "- AP " << k << " final success rate: " << models[k].GetProbability (params[k])
+                << " (optimum " << models[k].GetOptimum () << ")" << std::endl;
+    }
+
+  std::ostringstream csvOutput;
+  csvOutput << decisions << ',' << nAp << ',' << changeEvery << ',' << modelSeed << ',' << seed << ','
+            << decisionsPerSec << ',' << p50 << ',' << p99 << ',' << regret << ',' << finalRegret << std::endl;
+
+  std::cout << std::endl
+            << "decisions,nAp,changeEvery,modelSeed,seed,decisionsPerSec,p50Ms,p99Ms,regret,finalRegret"
+            << std::endl
+            << csvOutput.str ();
+
+  std::ofstream outputFile (csvPath);
+  outputFile << csvOutput.str ();
+  std::cout << std::endl << "Benchmark data saved to: " << csvPath << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,90 @@
+#ifndef FTM_AGENT_PROTOCOL_H
+#define FTM_AGENT_PROTOCOL_H
+
+// Data exchanged with the agents over ns3-ai shared memory, shared by the
+// scenario and the agent benchmark. The Python agents mirror these structs
+// with ctypes, keep both sides in sync.
+
+#include "ns3/ns3-ai-module.h"
+
+// Every AP has its own policy slot, all slots are exchanged in one round trip
+#define MAX_AP_SLOTS 8
+
+// Segment context: load bucket x power state x distance bucket
+#define N_LOAD_BUCKETS 4
+#define N_POWER_STATES 3
+#define N_DISTANCE_BUCKETS 4
+#define N_CONTEXTS (N_LOAD_BUCKETS * N_POWER_STATES * N_DISTANCE_BUCKETS)
+
+struct ApEnv
+{
+  uint8_t  ftmNumberOfBurstsExponent;
+  uint8_t  ftmBurstDuration;
+  uint8_t  ftmMinDeltaFtm;
+  uint16_t ftmPartialTsfTimer;
+  bool     ftmPartialTsfNoPref;
+  bool     ftmAsap;
+  uint8_t  ftmFtmsPerBurst;
+  uint16_t ftmBurstPeriod;
+  uint32_t attempts;   
+  uint32_t successes;  
+  uint32_t nWifi;      // stations associated with the AP
+  uint32_t dataRate;   // offered load of the BSS (Mb/s)
+  uint8_t  loadBucket;     // throughput received by the AP during the segment
+  uint8_t  powerState;     // 0 - all stations at low power, 1 - mixed, 2 - all at high power
+  uint8_t  distanceBucket; // mean distance of the stations from the AP
+  uint16_t context;        // (loadBucket * N_POWER_STATES + powerState) * N_DISTANCE_BUCKETS + distanceBucket
+}Packed;
+
+struct Env
+{
+  uint32_t nAp;
+  ApEnv    ap[MAX_AP_SLOTS];
+}Packed;
+
+struct ApAct
+{
+  uint8_t  ftmNumberOfBurstsExponent;
+  uint8_t  ftmBurstDuration;
+  uint8_t  ftmMinDeltaFtm;
+  uint16_t ftmPartialTsfTimer;
+  bool     ftmPartialTsfNoPref;
+  bool     ftmAsap;
+  uint8_t  ftmFtmsPerBurst;
+  uint16_t ftmBurstPeriod;
+  bool     apply;
+}Packed;
+
+struct Act
+{
+  ApAct    ap[MAX_AP_SLOTS];
+  uint32_t changeEvery;    // new segment length (sessions per AP), 0 keeps the current one
+}Packed;
+
+
+class FTMControl : public ns3::Ns3AIRL<Env, Act>
+{
+public:
+    FTMControl(uint16_t id);
+    Act GetFTMParams(const Env& env);
+};
+
+inline FTMControl::FTMControl(uint16_t id) : ns3::Ns3AIRL<Env, Act>(id)
+{
+    SetCond(2, 0);
+}
+
+inline Act FTMControl::GetFTMParams(const Env& env)
+{
+    auto envPtr = EnvSetterCond();
+    *envPtr = env;
+    SetCompleted();
+
+    auto actPtr = ActionGetterCond();
+    Act result = *actPtr;
+    GetCompleted();
+
+    return result;
+}
+
+#endif /* FTM_AGENT_PROTOCOL_H */
@@ -0,0 +1,259 @@
+import argparse
+import collections
+import hashlib
+import json
+import os
+import random
+import shutil
+import signal
+import subprocess
+import sys
+import time
+
+# Population based training: kilka par agent/scenario działa równolegle
+# (każda z własnymi kluczami pamięci współdzielonej), co pewien czas
+# najsłabsi członkowie przejmują stan najlepszych z zaburzonymi
+# hiperparametrami, łącznie z długością segmentu po stronie C++.
+
+AGENTS = {
+    'ts': 'ThompsonSampling.py',
+    'ppo': 'PPO.py',
+}
+
+# nazwa: (typ, min, max, wartość domyślna)
+HPARAM_SPACE = {
+    'ts': {
+        'changeEvery': (int, 2, 200, 10),
+    },
+    'ppo': {
+        'lr': (float, 1e-5, 1e-2, 3e-4),
+        'clipEps': (float, 0.05, 0.5, 0.2),
+        'entCoef': (float, 1e-4, 0.1, 0.01),
+        'batchSeg': (int, 8, 512, 64),
+        'changeEvery': (int, 2, 200, 10),
+    },
+}
+
+
+def write_json(path, data):
+    # zapis atomowy, druga strona nigdy nie czyta połowy pliku
+    tmp = path + '.tmp'
+    with open(tmp, 'w') as f:
+        json.dump(data, f)
+    os.replace(tmp, path)
+
+
+def read_json(path):
+    try:
+        with open(path) as f:
+            return json.load(f)
+    except (OSError, ValueError):
+        return None
+
+
+def agent_tag(name, hparams, checkpoint=None):
+    """Identyfikator agenta dla --agentTag (klucz cache wyników scenario):
+    nazwa, hiperparametry i skrót punktu kontrolnego, od którego agent startuje."""
+    digest = 'none'
+    if checkpoint and os.path.exists(checkpoint):
+        with open(checkpoint, 'rb') as f:
+            digest = hashlib.sha1(f.read()).hexdigest()[:16]
+    params = ','.join(f'{k}:{hparams[k]}' for k in sorted(hparams))
+    return f'{name},{params},checkpoint:{digest}'
+
+
+class PbtMember:
+    """Strona agenta: okno wyników, punkty kontrolne i polecenia koordynatora."""
+
+    def __init__(self, workdir, hparams, window=50, checkpoint_every=20):
+        os.makedirs(workdir, exist_ok=True)
+        self.workdir = workdir
+        self.hparams = dict(hparams)
+        self.window = collections.deque(maxlen=window)
+        self.checkpoint_every = checkpoint_every
+        self.segments = 0
+        self.checkpoint_path = os.path.join(workdir, 'checkpoint.npz')
+        self.status_path = os.path.join(workdir, 'status.json')
+        self.control_path = os.path.join(workdir, 'control.json')
+        # polecenia sprzed restartu są już zawarte w punkcie kontrolnym
+        control = read_json(self.control_path)
+        self.control_version = control['version'] if control else 0
+        if control:
+            self.hparams.update(control['hparams'])
+
+    def record(self, attempts, successes):
+        self.window.append((attempts, successes))
+        self.segments += 1
+        write_json(self.status_path, {
+            'segments': self.segments,
+            'windowSegments': len(self.window),
+            'attempts': sum(a for a, _ in self.window),
+            'successes': sum(s for _, s in self.window),
+            'hparams': self.hparams,
+        })
+
+    def checkpoint(self, save_fn):
+        if self.segments % self.checkpoint_every != 0:
+            return
+        tmp = os.path.join(self.workdir, 'checkpoint.tmp.npz')
+        save_fn(tmp)
+        os.replace(tmp, self.checkpoint_path)
+
+    def poll(self):
+        """Zwraca nowe polecenie koordynatora (checkpoint, hparams) albo None."""
+        control = read_json(self.control_path)
+        if control is None or control['version'] <= self.control_version:
+            return None
+        self.control_version = control['version']
+        self.hparams.update(control['hparams'])
+        self.window.clear()
+        return control
+
+
+def clip(kind, lo, hi, value):
+    value = min(max(value, lo), hi)
+    return int(round(value)) if kind is int else value
+
+
+def perturb(hparams, space, rng):
+    return {name: clip(space[name][0], space[name][1], space[name][2], value * rng.choice([0.8, 1.2]))
+            for name, value in hparams.items()}
+
+
+# stan członka z poprzedniego przebiegu koordynatora
+MEMBER_STATE = ['control.json', 'status.json', 'checkpoint.npz', 'checkpoint.tmp.npz', 'donor.npz']
+
+
+def clear_member(workdir):
+    # nowa populacja zaczyna od version=0 i własnych hiperparametrów, stare
+    # control.json blokowałoby polecenia i nadpisywało argumenty agenta
+    for name in MEMBER_STATE:
+        try:
+            os.remove(os.path.join(workdir, name))
+        except FileNotFoundError:
+            pass
+
+
+def hparam_args(hparams):
+    args = []
+    for name, value in hparams.items():
+        args += ['--' + name, str(value)]
+    return args
+
+
+def launch(member, args):
+    cmd = [sys.executable, os.path.join(args.ns3Path, 'scratch', AGENTS[args.agent]),
+           '--mempoolKey', str(args.mempoolKey + member['id']),
+           '--memblockKey', str(args.memblockKey + member['id']),
+           '--workdir', member['dir']] + hparam_args(member['hparams'])
+    for kv in args.set:
+        cmd += ['--set', kv]
+    log = open(os.path.join(member['dir'], 'agent.log'), 'a')
+    return subprocess.Popen(cmd, cwd=args.ns3Path, stdout=log, stderr=subprocess.STDOUT)
+
+
+def success_rate(status):
+    return status['successes'] / status['attempts'] if status['attempts'] else 0.0
+
+
+def exploit_and_explore(population, args, space, rng):
+    ready = []
+    for member in population:
+        status = read_json(os.path.join(member['dir'], 'status.json'))
+        if status and status['windowSegments'] >= args.minSegments:
+            member['hparams'] = status['hparams']
+            ready.append((success_rate(status), member))
+
+    if len(ready) < 2:
+        return
+
+    ready.sort(key=lambda x: x[0])
+    n = max(1, int(len(ready) * args.fraction))
+    bottom, top = ready[:n], ready[-n:]
+
+    for rate, worst in bottom:
+        best_rate, best = rng.choice(top)
+        checkpoint = os.path.join(best['dir'], 'checkpoint.npz')
+        if best is worst or not os.path.exists(checkpoint):
+            continue
+
+        donor = os.path.join(worst['dir'], 'donor.npz')
+        shutil.copyfile(checkpoint, donor)
+        worst['hparams'] = perturb(best['hparams'], space, rng)
+        worst['version'] += 1
+        write_json(os.path.join(worst['dir'], 'control.json'), {
+            'version': worst['version'],
+            'checkpoint': donor,
+            'hparams': worst['hparams'],
+        })
+        print(f"[PBT] member {worst['id']} ({rate:.3f}) <- member {best['id']} ({best_rate:.3f}) "
+              f"{worst['hparams']}", flush=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Population based training of FTM agents')
+    parser.add_argument('--agent', choices=AGENTS, default='ppo')
+    parser.add_argument('--population', type=int, default=4)
+    parser.add_argument('--budget', type=float, default=3600., help='czas całkowity (s)')
+    parser.add_argument('--interval', type=float, default=60., help='odstęp porównań (s)')
+    parser.add_argument('--fraction', type=float, default=0.25, help='część populacji wymieniana w kroku')
+    parser.add_argument('--minSegments', type=int, default=20, help='minimalna liczba segmentów w oknie')
+    parser.add_argument('--mempoolKey', type=int, default=1300)
+    parser.add_argument('--memblockKey', type=int, default=2400)
+    parser.add_argument('--ns3Path', default='.')
+    parser.add_argument('--workdir', default='pbt')
+    parser.add_argument('--seed', type=int, default=0)
+    parser.add_argument('--set', action='append', default=[], metavar='NAME=VALUE',
+                        help='argument przekazywany do scenario, np. simulationTime=100000')
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    space = HPARAM_SPACE[args.agent]
+    defaults = {name: spec[3] for name, spec in space.items()}
+
+    population = []
+    for i in range(args.population):
+        hparams = dict(defaults)
+        for _ in range(3 if i > 0 else 0):
+            hparams = perturb(hparams, space, rng)
+        member = dict(id=i, dir=os.path.abspath(os.path.join(args.workdir, f'member{i}')),
+                      hparams=hparams, version=0)
+        os.makedirs(member['dir'], exist_ok=True)
+        clear_member(member['dir'])
+        member['proc'] = launch(member, args)
+        population.append(member)
+        print(f"[PBT] member {i} started {hparams}", flush=True)
+
+    deadline = time.time() + args.budget
+
+    try:
+        while time.time() < deadline:
+            time.sleep(min(args.interval, max(0., deadline - time.time())))
+
+            # scenario skończyło symulację - wznów z ostatniego punktu kontrolnego
+            for member in population:
+                if member['proc'].poll() is not None:
+                    member['proc'] = launch(member, args)
+
+            exploit_and_explore(population, args, space, rng)
+    finally:
+        for member in population:
+            if member['proc'].poll() is None:
+                member['proc'].send_signal(signal.SIGINT)
+        for member in population:
+            member['proc'].wait()
+
+    results = []
+    for member in population:
+        status = read_json(os.path.join(member['dir'], 'status.json'))
+        if status:
+            results.append((success_rate(status), status['hparams'], member['id']))
+
+    if results:
+        rate, hparams, i = max(results, key=lambda x: x[0])
+        write_json(os.path.join(args.workdir, 'best.json'), {'member': i, 'successRate': rate, 'hparams': hparams})
+        print(f"[PBT] best member {i}: rate={rate:.3f} {hparams}")
+
+
+if __name__ == '__main__':
+    main()
@@ -1,11 +1,22 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <iomanip>
 #include <map>
+#include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "ns3/applications-module.h"
 #include "ns3/ap-wifi-mac.h"
+#include "ns3/constant-position-mobility-model.h"
 #include "ns3/core-module.h"
-#include "ns3/flow-monitor-module.h"
 #include "ns3/ftm-header.h"
 #include "ns3/ftm-error-model.h"
 #include "ns3/ftm-session.h"
@@ -15,102 +26,1084 @@
 #include "ns3/mobility-model.h"
 #include "ns3/node-container.h"
 #include "ns3/node-list.h"
+#include "ns3/propagation-delay-model.h"
+#include "ns3/propagation-loss-model.h"
+#include "ns3/qos-txop.h"
 #include "ns3/ssid.h"
+#include "ns3/sta-wifi-mac.h"
+#include "ns3/wifi-mac-queue.h"
 #include "ns3/wifi-net-device.h"
+#include "ns3/yans-wifi-channel.h"
 #include "ns3/yans-wifi-helper.h"
 
 #include "ns3/core-module.h"
 #include "ns3/ns3-ai-module.h"
 #include "ns3/system-path.h" 
 
+#include "ftm-agent-protocol.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
 using namespace ns3;
 
-NS_LOG_COMPONENT_DEFINE ("ftm-optimal");
+NS_LOG_COMPONENT_DEFINE ("ftm-optimal");
+
+
+/***** Static path loss cache *****/
+
+// Propagation loss for topologies in which no node moves. The deterministic
+// path loss of every node pair is computed once in Build (), so per frame
+// only two index lookups by node ID and the optional fading term remain.
+// Fading is skipped for links which stay below RxSensitivity even with
+// FadingMargin dB of gain. This is a heuristic: Nakagami gain is unbounded
+// and RxSensitivity is a separate copy, not read from the PHY, so keep the
+// two in sync. In dense topologies (e.g. Hidden) no link is that weak and
+// the fading is always drawn.
+class StaticPathLossCache : public PropagationLossModel
+{
+public:
+  static TypeId GetTypeId (void);
+  StaticPathLossCache ();
+
+  void Build (NodeContainer nodes, Ptr<PropagationLossModel> pathLoss);
+  void SetFading (Ptr<PropagationLossModel> fading);
+
+private:
+  virtual double DoCalcRxPower (double txPowerDbm, Ptr<MobilityModel> a, Ptr<MobilityModel> b) const;
+  virtual int64_t DoAssignStreams (int64_t stream);
+
+  uint32_t GetIndex (Ptr<MobilityModel> model) const;
+
+  std::vector<uint32_t> m_index; // matrix row of every node, by node ID
+  std::vector<double> m_loss; // m_n x m_n matrix, row = transmitter (dB)
+  uint32_t m_n;
+  Ptr<PropagationLossModel> m_fading;
+  double m_rxSensitivity;
+  double m_fadingMargin;
+};
+
+NS_OBJECT_ENSURE_REGISTERED (StaticPathLossCache);
+
+TypeId
+StaticPathLossCache::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("StaticPathLossCache")
+    .SetParent<PropagationLossModel> ()
+    .AddConstructor<StaticPathLossCache> ()
+    .AddAttribute ("RxSensitivity", "Receiver sensitivity (dBm)",
+                   DoubleValue (-101.0),
+                   MakeDoubleAccessor (&StaticPathLossCache::m_rxSensitivity),
+                   MakeDoubleChecker<double> ())
+    .AddAttribute ("FadingMargin", "Largest fading gain assumed when skipping weak links (dB)",
+                   DoubleValue (30.0),
+                   MakeDoubleAccessor (&StaticPathLossCache::m_fadingMargin),
+                   MakeDoubleChecker<double> (0.0));
+  return tid;
+}
+
+StaticPathLossCache::StaticPathLossCache () : m_n (0)
+{
+}
+
+void
+StaticPathLossCache::Build (NodeContainer nodes, Ptr<PropagationLossModel> pathLoss)
+{
+  std::vector<Ptr<MobilityModel>> mobility;
+  m_n = nodes.GetN ();
+  m_index.assign (NodeList::GetNNodes (), UINT32_MAX);
+
+  for (uint32_t i = 0; i < m_n; ++i)
+    {
+      Ptr<MobilityModel> model = nodes.Get (i)->GetObject<MobilityModel> ();
+      NS_ABORT_MSG_UNLESS (DynamicCast<ConstantPositionMobilityModel> (model),
+                           "Path loss cache requires constant node positions");
+      m_index[nodes.Get (i)->GetId ()] = i;
+      mobility.push_back (model);
+    }
+
+  m_loss.assign (m_n * m_n, 0.);
+  for (uint32_t i = 0; i < m_n; ++i)
+    {
+      for (uint32_t j = 0; j < m_n; ++j)
+        {
+          if (i != j)
+            {
+              m_loss[i * m_n + j] = -pathLoss->CalcRxPower (0., mobility[i], mobility[j]);
+            }
+        }
+    }
+}
+
+void
+StaticPathLossCache::SetFading (Ptr<PropagationLossModel> fading)
+{
+  m_fading = fading;
+}
+
+uint32_t
+StaticPathLossCache::GetIndex (Ptr<MobilityModel> model) const
+{
+  uint32_t id = model->GetObject<Node> ()->GetId ();
+  NS_ABORT_MSG_IF (id >= m_index.size () || m_index[id] == UINT32_MAX, "Node missing from the path loss cache");
+  return m_index[id];
+}
+
+double
+StaticPathLossCache::DoCalcRxPower (double txPowerDbm, Ptr<MobilityModel> a, Ptr<MobilityModel> b) const
+{
+  double rxPowerDbm = txPowerDbm - m_loss[GetIndex (a) * m_n + GetIndex (b)];
+
+  // Most likely dropped by the receiver anyway, skip drawing the fading
+  if (m_fading == 0 || rxPowerDbm + m_fadingMargin < m_rxSensitivity)
+    {
+      return rxPowerDbm;
+    }
+
+  return m_fading->CalcRxPower (rxPowerDbm, a, b);
+}
+
+int64_t
+StaticPathLossCache::DoAssignStreams (int64_t stream)
+{
+  return m_fading == 0 ? 0 : m_fading->AssignStreams (stream);
+}
+
+
+/***** Trace mobility *****/
+
+// Station trajectories exported with --traceExport. The file holds a header,
+// the index of the first sample of every node and the samples: positions at
+// every course change, between which nodes move along straight lines. It is
+// memory-mapped and positions are interpolated only when somebody asks.
+#define TRACE_MAGIC "FTMTRACE"
+#define TRACE_VERSION 1
+
+struct TraceFileHeader
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t nNodes;
+  double   duration; // s
+  double   maxSpeed; // m/s, reported in the results CSV
+}Packed;
+
+struct TraceSample
+{
+  double time;       // s
+  float  x, y, z;    // m
+}Packed;
+
+class MobilityTrace : public SimpleRefCount<MobilityTrace>
+{
+public:
+  MobilityTrace ();
+  ~MobilityTrace ();
+
+  bool Open (const std::string &path);
+  uint32_t GetNNodes (void) const;
+  double GetMaxSpeed (void) const;
+  double GetDuration (void) const;
+  const char *GetData (void) const;
+  size_t GetSize (void) const;
+  const TraceSample *GetSamples (uint32_t node, uint64_t &count) const;
+  Vector GetFirstWaypoint (uint32_t node) const;
+
+  static bool Write (const std::string &path, const std::vector<std::vector<TraceSample>> &samples,
+                     double duration, double maxSpeed);
+
+private:
+  void *m_data;
+  size_t m_size;
+  const TraceFileHeader *m_header;
+  const uint64_t *m_first; // nNodes + 1 entries, samples of node i are [m_first[i], m_first[i + 1])
+  const TraceSample *m_samples;
+};
+
+// Samples of one station collected during --traceExport
+struct TraceRecorder
+{
+  std::vector<TraceSample> samples;
+  Vector velocity; // since the last sample
+};
+
+MobilityTrace::MobilityTrace () : m_data (MAP_FAILED), m_size (0)
+{
+}
+
+MobilityTrace::~MobilityTrace ()
+{
+  if (m_data != MAP_FAILED)
+    {
+      munmap (m_data, m_size);
+    }
+}
+
+bool
+MobilityTrace::Open (const std::string &path)
+{
+  int fd = open (path.c_str (), O_RDONLY);
+  if (fd < 0)
+    {
+      return false;
+    }
+
+  struct stat st;
+  if (fstat (fd, &st) == 0 && st.st_size >= (off_t) sizeof (TraceFileHeader))
+    {
+      m_size = st.st_size;
+      m_data = mmap (nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+  close (fd);
+
+  if (m_data == MAP_FAILED)
+    {
+      return false;
+    }
+
+  m_header = static_cast<const TraceFileHeader *> (m_data);
+  if (std::string (m_header->magic, 8) != TRACE_MAGIC || m_header->version != TRACE_VERSION)
+    {
+      return false;
+    }
+
+  uint64_t indexEnd = sizeof (TraceFileHeader) + ((uint64_t) m_header->nNodes + 1) * sizeof (uint64_t);
+  if (m_size < indexEnd)
+    {
+      return false;
+    }
+
+  m_first = reinterpret_cast<const uint64_t *> (static_cast<const char *> (m_data) + sizeof (TraceFileHeader));
+  m_samples = reinterpret_cast<const TraceSample *> (static_cast<const char *> (m_data) + indexEnd);
+
+  // Every node needs at least one sample, and the samples must fill the file
+  for (uint32_t i = 0; i < m_header->nNodes; ++i)
+    {
+      if (m_first[i + 1] <= m_first[i])
+        {
+          return false;
+        }
+    }
+
+  uint64_t nSamples = m_first[m_header->nNodes];
+  return m_first[0] == 0 && nSamples == (m_size - indexEnd) / sizeof (TraceSample)
+         && m_size == indexEnd + nSamples * sizeof (TraceSample);
+}
+
+uint32_t
+MobilityTrace::GetNNodes (void) const
+{
+  return m_header->nNodes;
+}
+
+double
+MobilityTrace::GetMaxSpeed (void) const
+{
+  return m_header->maxSpeed;
+}
+
+double
+MobilityTrace::GetDuration (void) const
+{
+  return m_header->duration;
+}
+
+const char *
+MobilityTrace::GetData (void) const
+{
+  return static_cast<const char *> (m_data);
+}
+
+size_t
+MobilityTrace::GetSize (void) const
+{
+  return m_size;
+}
+
+const TraceSample *
+MobilityTrace::GetSamples (uint32_t node, uint64_t &count) const
+{
+  count = m_first[node + 1] - m_first[node];
+  return m_samples + m_first[node];
+}
+
+Vector
+MobilityTrace::GetFirstWaypoint (uint32_t node) const
+{
+  // Exported RWPM trajectories start at the origin, the first position which
+  // differs from the start is where the station is heading (or parked)
+  uint64_t count;
+  const TraceSample *samples = GetSamples (node, count);
+  uint64_t i = 0;
+
+  while (i + 1 < count && samples[i].x == samples[0].x && samples[i].y == samples[0].y
+         && samples[i].z == samples[0].z)
+    {
+      ++i;
+    }
+
+  return Vector (samples[i].x, samples[i].y, samples[i].z);
+}
+
+bool
+MobilityTrace::Write (const std::string &path, const std::vector<std::vector<TraceSample>> &samples,
+                      double duration, double maxSpeed)
+{
+  std::ofstream file (path, std::ios::binary);
+
+  TraceFileHeader header;
+  std::copy (TRACE_MAGIC, TRACE_MAGIC + 8, header.magic);
+  header.version = TRACE_VERSION;
+  header.nNodes = samples.size ();
+  header.duration = duration;
+  header.maxSpeed = maxSpeed;
+  file.write (reinterpret_cast<const char *> (&header), sizeof (header));
+
+  uint64_t first = 0;
+  for (const auto &node : samples)
+    {
+      file.write (reinterpret_cast<const char *> (&first), sizeof (first));
+      first += node.size ();
+    }
+  file.write (reinterpret_cast<const char *> (&first), sizeof (first));
+
+  for (const auto &node : samples)
+    {
+      file.write (reinterpret_cast<const char *> (node.data ()), node.size () * sizeof (TraceSample));
+    }
+
+  return file.good ();
+}
+
+// Plays back one node of a mobility trace. Nothing is scheduled, the position
+// is interpolated between the samples surrounding the current time.
+class TraceMobilityModel : public MobilityModel
+{
+public:
+  static TypeId GetTypeId (void);
+  TraceMobilityModel ();
+
+  void SetTrace (Ptr<MobilityTrace> trace, uint32_t node);
+
+private:
+  uint64_t Seek (double now) const;
+  virtual Vector DoGetPosition (void) const;
+  virtual void DoSetPosition (const Vector &position);
+  virtual Vector DoGetVelocity (void) const;
+
+  Ptr<MobilityTrace> m_trace;
+  const TraceSample *m_samples;
+  uint64_t m_count;
+  mutable uint64_t m_cursor; // time only goes forward, so the search continues from here
+};
+
+NS_OBJECT_ENSURE_REGISTERED (TraceMobilityModel);
+
+TypeId
+TraceMobilityModel::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("TraceMobilityModel")
+    .SetParent<MobilityModel> ()
+    .AddConstructor<TraceMobilityModel> ();
+  return tid;
+}
+
+TraceMobilityModel::TraceMobilityModel () : m_samples (nullptr), m_count (0), m_cursor (0)
+{
+}
+
+void
+TraceMobilityModel::SetTrace (Ptr<MobilityTrace> trace, uint32_t node)
+{
+  m_trace = trace;
+  m_samples = trace->GetSamples (node, m_count);
+  m_cursor = 0;
+}
+
+uint64_t
+TraceMobilityModel::Seek (double now) const
+{
+  // Index of the last sample not later than now (or the first one)
+  while (m_cursor + 1 < m_count && m_samples[m_cursor + 1].time <= now)
+    {
+      m_cursor++;
+    }
+
+  return m_cursor;
+}
+
+Vector
+TraceMobilityModel::DoGetPosition (void) const
+{
+  double now = Simulator::Now ().GetSeconds ();
+  const TraceSample &from = m_samples[Seek (now)];
+
+  if (m_cursor + 1 == m_count || now <= from.time)
+    {
+      return Vector (from.x, from.y, from.z);
+    }
+
+  const TraceSample &to = m_samples[m_cursor + 1];
+  double f = (now - from.time) / (to.time - from.time);
+  return Vector (from.x + f * (to.x - from.x), from.y + f * (to.y - from.y), from.z + f * (to.z - from.z));
+}
+
+void
+TraceMobilityModel::DoSetPosition (const Vector &position)
+{
+  NS_ABORT_MSG ("Positions of trace driven nodes come from the trace file");
+}
+
+Vector
+TraceMobilityModel::DoGetVelocity (void) const
+{
+  double now = Simulator::Now ().GetSeconds ();
+  const TraceSample &from = m_samples[Seek (now)];
+
+  if (m_cursor + 1 == m_count || now < from.time)
+    {
+      return Vector (0., 0., 0.);
+    }
+
+  const TraceSample &to = m_samples[m_cursor + 1];
+  double dt = to.time - from.time;
+  return Vector ((to.x - from.x) / dt, (to.y - from.y) / dt, (to.z - from.z) / dt);
+}
+
+
+/***** Traffic applications *****/
+
+// Constant rate UDP source of a station. Sends warmup traffic from its start
+// time and switches to the measured rate by itself at the switch time, so a
+// single application and socket serve both stages.
+class StaTrafficApplication : public Application
+{
+public:
+  static TypeId GetTypeId (void);
+  StaTrafficApplication ();
+
+  void Setup (Address peer, uint32_t packetSize, DataRate warmupRate, DataRate dataRate, Time switchTime);
+
+private:
+  virtual void StartApplication (void);
+  virtual void StopApplication (void);
+
+  void ScheduleTx (void);
+  void SendPacket (void);
+  void SwitchRate (void);
+
+  Ptr<Socket> m_socket;
+  Address m_peer;
+  uint32_t m_packetSize;
+  DataRate m_rate;
+  DataRate m_warmupRate;
+  DataRate m_dataRate;
+  Time m_switchTime;
+  uint32_t m_warmupPackets;
+  uint32_t m_warmupSent;
+  EventId m_sendEvent;
+  EventId m_switchEvent;
+};
+
+NS_OBJECT_ENSURE_REGISTERED (StaTrafficApplication);
+
+TypeId
+StaTrafficApplication::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("StaTrafficApplication")
+    .SetParent<Application> ()
+    .AddConstructor<StaTrafficApplication> ()
+    .AddAttribute ("WarmupPackets", "Packets sent at the warmup rate before waiting for the switch (0 - no limit)",
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&StaTrafficApplication::m_warmupPackets),
+                   MakeUintegerChecker<uint32_t> ());
+  return tid;
+}
+
+StaTrafficApplication::StaTrafficApplication () : m_packetSize (0), m_warmupPackets (0), m_warmupSent (0)
+{
+}
+
+void
+StaTrafficApplication::Setup (Address peer, uint32_t packetSize, DataRate warmupRate, DataRate dataRate,
+                              Time switchTime)
+{
+  m_peer = peer;
+  m_packetSize = packetSize;
+  m_warmupRate = warmupRate;
+  m_dataRate = dataRate;
+  m_switchTime = switchTime;
+}
+
+void
+StaTrafficApplication::StartApplication (void)
+{
+  m_socket = Socket::CreateSocket (GetNode (), UdpSocketFactory::GetTypeId ());
+  m_socket->Bind ();
+  m_socket->Connect (m_peer);
+
+  if (Simulator::Now () < m_switchTime)
+    {
+      m_rate = m_warmupRate;
+      m_switchEvent = Simulator::Schedule (m_switchTime - Simulator::Now (), &StaTrafficApplication::SwitchRate, this);
+    }
+  else
+    {
+      m_rate = m_dataRate;
+    }
+
+  ScheduleTx ();
+}
+
+void
+StaTrafficApplication::StopApplication (void)
+{
+  Simulator::Cancel (m_sendEvent);
+  Simulator::Cancel (m_switchEvent);
+
+  if (m_socket)
+    {
+      m_socket->Close ();
+    }
+}
+
+void
+StaTrafficApplication::ScheduleTx (void)
+{
+  if (m_rate.GetBitRate () == 0)
+    {
+      return;
+    }
+
+  // Same pacing as OnOffApplication with a constant rate
+  Time interval = Seconds (m_packetSize * 8 / static_cast<double> (m_rate.GetBitRate ()));
+  m_sendEvent = Simulator::Schedule (interval, &StaTrafficApplication::SendPacket, this);
+}
+
+void
+StaTrafficApplication::SendPacket (void)
+{
+  m_socket->Send (Create<Packet> (m_packetSize));
+
+  // Fast warmup, only the first packets are sent, then the station waits for the switch
+  if (m_warmupPackets > 0 && Simulator::Now () < m_switchTime && ++m_warmupSent >= m_warmupPackets)
+    {
+      return;
+    }
+
+  ScheduleTx ();
+}
+
+void
+StaTrafficApplication::SwitchRate (void)
+{
+  Simulator::Cancel (m_sendEvent);
+  m_rate = m_dataRate;
+  ScheduleTx ();
+}
+
+// UDP sink of the AP. Received bytes are demultiplexed by source address
+// into flat per-station counters, station j having address firstStation + j.
+class ApTrafficSink : public Application
+{
+public:
+  static TypeId GetTypeId (void);
+  ApTrafficSink ();
+
+  void Setup (uint16_t port, Ipv4Address firstStation, uint32_t nStations);
+  uint64_t GetRxBytes (uint32_t staId) const;
+  uint64_t GetTotalRxBytes (void) const;
+
+private:
+  virtual void StartApplication (void);
+  virtual void StopApplication (void);
+
+  void HandleRead (Ptr<Socket> socket);
+
+  // IPv4 and UDP headers, counted to match FlowMonitor byte counts
+  static const uint32_t HEADERS_SIZE = 28;
+
+  Ptr<Socket> m_socket;
+  uint16_t m_port;
+  Ipv4Address m_firstStation;
+  std::vector<uint64_t> m_rxBytes;
+  uint64_t m_totalRxBytes;
+};
+
+NS_OBJECT_ENSURE_REGISTERED (ApTrafficSink);
+
+TypeId
+ApTrafficSink::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ApTrafficSink")
+    .SetParent<Application> ()
+    .AddConstructor<ApTrafficSink> ();
+  return tid;
+}
+
+ApTrafficSink::ApTrafficSink () : m_port (0), m_totalRxBytes (0)
+{
+}
+
+void
+ApTrafficSink::Setup (uint16_t port, Ipv4Address firstStation, uint32_t nStations)
+{
+  m_port = port;
+  m_firstStation = firstStation;
+  m_rxBytes.assign (nStations, 0);
+}
+
+uint64_t
+ApTrafficSink::GetRxBytes (uint32_t staId) const
+{
+  return m_rxBytes[staId];
+}
+
+uint64_t
+ApTrafficSink::GetTotalRxBytes (void) const
+{
+  return m_totalRxBytes;
+}
+
+void
+ApTrafficSink::StartApplication (void)
+{
+  m_socket = Socket::CreateSocket (GetNode (), UdpSocketFactory::GetTypeId ());
+  m_socket->Bind (InetSocketAddress (Ipv4Address::GetAny (), m_port));
+  m_socket->SetRecvCallback (MakeCallback (&ApTrafficSink::HandleRead, this));
+}
+
+void
+ApTrafficSink::StopApplication (void)
+{
+  if (m_socket)
+    {
+      m_socket->Close ();
+      m_socket->SetRecvCallback (MakeNullCallback<void, Ptr<Socket>> ());
+    }
+}
+
+void
+ApTrafficSink::HandleRead (Ptr<Socket> socket)
+{
+  Ptr<Packet> packet;
+  Address from;
+
+  while ((packet = socket->RecvFrom (from)))
+    {
+      uint32_t staId = InetSocketAddress::ConvertFrom (from).GetIpv4 ().Get () - m_firstStation.Get ();
+
+      if (staId < m_rxBytes.size ())
+        {
+          m_rxBytes[staId] += packet->GetSize () + HEADERS_SIZE;
+          m_totalRxBytes += packet->GetSize () + HEADERS_SIZE;
+        }
+    }
+}
+
+
+/***** Control socket *****/
+
+// Line based commands on a Unix domain socket, served by a side thread which
+// accepts one client at a time. Every command runs on the simulator thread
+// (ScheduleWithContext may be called from other threads), the side thread
+// only waits for the reply. Replies are single line JSON objects. Commands
+// which do not start in time are dropped, so every reply is final.
+class ControlSocket
+{
+public:
+  typedef std::string (*Handler) (const std::string &command);
+
+  ControlSocket ();
+  ~ControlSocket ();
+
+  bool Start (const std::string &path, Handler handler);
+  void Stop (void);
+
+private:
+  // Pending until the simulator thread starts it or Execute gives up
+  struct Request
+  {
+    enum State
+    {
+      PENDING,
+      RUNNING,
+      DROPPED
+    };
+
+    std::string command;
+    std::promise<std::string> reply;
+    std::atomic<int> state;
+  };
+
+  static void Dispatch (Handler handler, std::shared_ptr<Request> request);
+  void Serve (void);
+  void ServeClient (int fd);
+  std::string Execute (const std::string &command);
+
+  std::string m_path;
+  Handler m_handler;
+  int m_listenFd;
+  std::atomic<bool> m_running;
+  std::thread m_thread;
+};
+
+ControlSocket::ControlSocket () : m_handler (nullptr), m_listenFd (-1), m_running (false)
+{
+}
+
+ControlSocket::~ControlSocket ()
+{
+  Stop ();
+}
+
+bool
+ControlSocket::Start (const std::string &path, Handler handler)
+{
+  struct sockaddr_un addr;
+  if (path.size () >= sizeof (addr.sun_path))
+    {
+      return false;
+    }
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strncpy (addr.sun_path, path.c_str (), sizeof (addr.sun_path) - 1);
+
+  // Replace the socket of an earlier run, never any other file
+  struct stat st;
+  if (lstat (path.c_str (), &st) == 0)
+    {
+      if (!S_ISSOCK (st.st_mode))
+        {
+          return false;
+        }
+      unlink (path.c_str ());
+    }
+
+  m_listenFd = socket (AF_UNIX, SOCK_STREAM, 0);
+
+  if (m_listenFd < 0 || bind (m_listenFd, (struct sockaddr *) &addr, sizeof (addr)) < 0
+      || listen (m_listenFd, 4) < 0)
+    {
+      if (m_listenFd >= 0)
+        {
+          close (m_listenFd);
+          m_listenFd = -1;
+        }
+      return false;
+    }
+
+  m_path = path;
+  m_handler = handler;
+  m_running = true;
+  m_thread = std::thread (&ControlSocket::Serve, this);
+  return true;
+}
+
+void
+ControlSocket::Stop (void)
+{
+  if (!m_running)
+    {
+      return;
+    }
+
+  m_running = false;
+  m_thread.join ();
+  close (m_listenFd);
+  unlink (m_path.c_str ());
+  m_listenFd = -1;
+}
 
+void
+ControlSocket::Dispatch (Handler handler, std::shared_ptr<Request> request)
+{
+  int pending = Request::PENDING;
+  if (request->state.compare_exchange_strong (pending, Request::RUNNING))
+    {
+      request->reply.set_value (handler (request->command));
+    }
+}
 
-struct Env
-{
-  uint8_t  ftmNumberOfBurstsExponent;
-  uint8_t  ftmBurstDuration;
-  uint8_t  ftmMinDeltaFtm;
-  uint16_t ftmPartialTsfTimer;
-  bool     ftmPartialTsfNoPref;
-  bool     ftmAsap;
-  uint8_t  ftmFtmsPerBurst;
-  uint16_t ftmBurstPeriod;
-  uint32_t attempts;   
-  uint32_t successes;  
-  uint32_t nWifi;
-  uint32_t dataRate;
-}Packed;
+void
+ControlSocket::Serve (void)
+{
+  // Short poll timeouts, so Stop () never waits long for the thread
+  struct pollfd pfd = {m_listenFd, POLLIN, 0};
 
-struct Act
-{
-  uint8_t  ftmNumberOfBurstsExponent;
-  uint8_t  ftmBurstDuration;
-  uint8_t  ftmMinDeltaFtm;
-  uint16_t ftmPartialTsfTimer;
-  bool     ftmPartialTsfNoPref;
-  bool     ftmAsap;
-  uint8_t  ftmFtmsPerBurst;
-  uint16_t ftmBurstPeriod;
-  bool     apply;
-}Packed;
+  while (m_running)
+    {
+      if (poll (&pfd, 1, 200) > 0)
+        {
+          int fd = accept (m_listenFd, nullptr, nullptr);
+          if (fd >= 0)
+            {
+              ServeClient (fd);
+              close (fd);
+            }
+        }
+    }
+}
+
+void
+ControlSocket::ServeClient (int fd)
+{
+  struct pollfd pfd = {fd, POLLIN, 0};
+  std::string buffer;
+  char data[1024];
+
+  while (m_running)
+    {
+      if (poll (&pfd, 1, 200) <= 0)
+        {
+          continue;
+        }
+
+      ssize_t n = read (fd, data, sizeof (data));
+      if (n <= 0)
+        {
+          return;
+        }
+
+      buffer.append (data, n);
+
+      size_t end;
+      while ((end = buffer.find ('\n')) != std::string::npos)
+        {
+          std::string command = buffer.substr (0, end);
+          buffer.erase (0, end + 1);
 
+          if (!command.empty () && command.back () == '\r')
+            {
+              command.pop_back ();
+            }
+
+          if (command.empty ())
+            {
+              continue;
+            }
+
+          std::string reply = Execute (command) + "\n";
+          if (send (fd, reply.data (), reply.size (), MSG_NOSIGNAL) < 0)
+            {
+              return;
+            }
+        }
+    }
+}
 
-class FTMControl : public Ns3AIRL<Env, Act>
+std::string
+ControlSocket::Execute (const std::string &command)
 {
-public:
-    FTMControl(uint16_t id);
-    Act GetFTMParams(const Env& env);
+  auto request = std::make_shared<Request> ();
+  request->command = command;
+  request->state = Request::PENDING;
+  std::future<std::string> result = request->reply.get_future ();
+
+  Simulator::ScheduleWithContext (Simulator::NO_CONTEXT, Seconds (0), &ControlSocket::Dispatch, m_handler,
+                                  request);
+
+  // The simulator thread is blocked while the agent computes its action. A
+  // command already running is waited for, handlers return quickly.
+  int pending = Request::PENDING;
+  if (result.wait_for (std::chrono::seconds (2)) != std::future_status::ready
+      && request->state.compare_exchange_strong (pending, Request::DROPPED))
+    {
+      return "{\"error\":\"simulator busy, command dropped\"}";
+    }
+
+  return result.get ();
+}
+
+
+/***** Warmup snapshot *****/
+
+// State of the network at the end of the warmup, saved by a cold run with
+// --warmupSnapshot, one file per warmup key. ns-3 cannot restore MAC state,
+// queues or positions of random streams, so runs with the same warmup key
+// recreate the state instead: every station sends a single warmup packet at
+// its fuzzed start time instead of the 0.1 Mb/s warmup traffic (stations
+// associate on their own either way), and the measured phase starts at the
+// usual time. Their state at the end of the warmup and their results are
+// compared with the snapshot to show how far the fast start diverges from
+// the cold one.
+struct WarmupStation
+{
+  uint64_t warmupBits;   // received by the AP during the warmup
+  double   x, y;         // position (m)
+  bool     associated;
+  uint32_t queuePackets; // BE queue of the station
+  uint32_t queueBytes;
 };
 
-FTMControl::FTMControl(uint16_t id) : Ns3AIRL<Env, Act>(id)
+struct WarmupSnapshot
 {
-    SetCond(2, 0);  
+  std::string key;
+  double wallTime = 0.;      // simulating the warmup (s)
+  std::vector<WarmupStation> stations;
+  std::string resultsKey;    // run whose results are saved, empty if none
+  double throughput = 0.;
+  double ftmSuccessRate = 0.;
+
+  bool Load (const std::string &path);
+  bool Save (const std::string &path) const;
+};
+
+bool
+WarmupSnapshot::Load (const std::string &path)
+{
+  std::ifstream file (path);
+  std::string line;
+
+  while (std::getline (file, line))
+    {
+      std::istringstream in (line);
+      std::string field;
+      in >> field;
+
+      if (field == "key")
+        {
+          in >> key;
+        }
+      else if (field == "wallTime")
+        {
+          in >> wallTime;
+        }
+      else if (field == "results")
+        {
+          in >> resultsKey >> throughput >> ftmSuccessRate;
+        }
+      else if (field == "station")
+        {
+          WarmupStation station;
+          in >> station.warmupBits >> station.x >> station.y >> station.associated >> station.queuePackets
+             >> station.queueBytes;
+          stations.push_back (station);
+        }
+    }
+
+  return !key.empty ();
 }
 
-Act FTMControl::GetFTMParams(const Env& env)
+bool
+WarmupSnapshot::Save (const std::string &path) const
 {
-    auto envPtr = EnvSetterCond();
-    *envPtr = env;
-    SetCompleted();
+  std::ofstream file (path + ".tmp");
+  file << "key " << key << std::endl
+       << "wallTime " << wallTime << std::endl;
 
-    auto actPtr = ActionGetterCond();
-    Act result = *actPtr;
-    GetCompleted();
+  if (!resultsKey.empty ())
+    {
+      file << "results " << resultsKey << " " << throughput << " " << ftmSuccessRate << std::endl;
+    }
+
+  for (const WarmupStation &station : stations)
+    {
+      file << "station " << station.warmupBits << " " << station.x << " " << station.y << " "
+           << station.associated << " " << station.queuePackets << " " << station.queueBytes << std::endl;
+    }
 
-    return result;
+  file.close ();
+  return file.good () && std::rename ((path + ".tmp").c_str (), path.c_str ()) == 0;
 }
 
+
 namespace {
-  // co ile sesji zmieniać parametry:
+  // co ile sesji (na AP) zmieniać parametry:
   static uint32_t g_changeEvery = 10;
-  static uint32_t g_sessionsSinceChange = 0;
+  static uint32_t g_sessionsSinceChange = 0; // sesje wszystkich AP
+
+  // liczniki segmentu dla każdego AP
+  static std::vector<uint32_t> g_sessionsTotal; // wszystkie zakończone sesje
+  static std::vector<uint32_t> g_sessionsOk; // udane sesje
+
+  // parametry FTM stosowane przez każdy AP
+  static std::vector<ApAct> g_apParams;
+  static std::vector<FtmParams> g_apFtmParams;
 
-  static uint32_t g_sessionsTotal = 0; // wszystkie zakończone sesje
-  static uint32_t g_sessionsOk = 0; // udane sesje
+  static std::vector<uint32_t> g_apStations; // stacje w BSS
+  static std::vector<uint32_t> g_apDataRate; // obciążenie BSS (Mb/s)
+
+  // stan sieci do wyznaczenia kontekstu segmentu
+  static std::vector<uint32_t> g_staAp;
+  static std::vector<bool> g_staHighPower;
+  static std::vector<Ptr<MobilityModel>> g_staMobility;
+  static std::vector<Ptr<MobilityModel>> g_apMobility;
+  static std::vector<Ptr<ApTrafficSink>> g_apSinks;
+  static std::vector<Time> g_segmentStart;
+  static std::vector<uint64_t> g_segmentRxBytes;
+
+  // górne granice przedziałów (ostatni przedział otwarty)
+  static const double g_loadEdges[N_LOAD_BUCKETS - 1] = {5., 20., 50.}; // Mb/s
+  static const double g_distanceEdges[N_DISTANCE_BUCKETS - 1] = {10., 20., 40.}; // m
 
   static FTMControl* g_ftmCtrl = nullptr;
+
+  // czas odpowiedzi agenta (ms): ostatnie g_agentLatencyWindow wymian w buforze
+  // cyklicznym dla percentyli, średnia i maksimum z całego przebiegu
+  static const size_t g_agentLatencyWindow = 1024;
+  static std::vector<double> g_agentLatency;
+  static uint64_t g_agentExchanges = 0;
+  static double g_agentLatencySum = 0.;
+  static double g_agentLatencyMax = 0.;
+  static double g_agentLatencyLast = 0.;
+
+  // dla gniazda sterującego: start Simulator::Run i ścieżki wyników
+  static std::chrono::steady_clock::time_point g_runStart;
+  static std::string g_csvPath;
+  static std::string g_logPath;
+  static bool g_controlSteered = false; // wynik zależy od poleceń, nie trafia do cache
+  static bool g_changeEveryPinned = false; // ustawione przez gniazdo, agent go nie zmienia
+
+  // migawka stanu po rozgrzewce: zapisana (szybki start) albo mierzona w tym przebiegu (zimny start)
+  static std::string g_warmupSnapshotPath;
+  static WarmupSnapshot g_warmupSnapshot;
+  static bool g_warmupFast = false;
 }
 
 
 /***** Functions declarations *****/
 
-void ChangePower (Ptr<Node> staNode, uint8_t powerLevel);
-void GetWarmupFlows (Ptr<FlowMonitor> monitor);
-void InstallTrafficGenerator (Ptr<ns3::Node> fromNode, Ptr<ns3::Node> toNode, uint32_t port,
-                              DataRate offeredLoad, uint32_t packetSize, double startTime, double stopTime);
+void ChangePower (uint32_t staId, Ptr<WifiNetDevice> staDevice, uint8_t powerLevel);
+void GetWarmupFlows (std::vector<Ptr<ApTrafficSink>> sinks, uint32_t nStations);
+void WarmupEnd (NetDeviceContainer staDevices);
+void InstallTrafficGenerator (Ptr<ns3::Node> fromNode, Ptr<ns3::Node> toNode, uint32_t port, DataRate warmupLoad,
+                              DataRate offeredLoad, uint32_t packetSize, double stopTime);
 void LogSuccessRate ();
 void PopulateArpCache ();
 void SetPosition (Ptr<MobilityModel> mobilityModel, Vector3D pos);
+std::vector<Vector> InstallRandomWaypoint (NodeContainer stations, double area, double nodeSpeed, double nodePause);
+void RecordCourseChange (TraceRecorder *recorder, Ptr<const MobilityModel> model);
+bool ExportMobilityTrace (const std::string &path, uint32_t nWifi, double area, double nodeSpeed,
+                          double nodePause);
 void SetFtmParams (FtmParams ftmParams);
-void FtmBurst (uint32_t staId, Ptr <WifiNetDevice> device, Mac48Address apAddress);
-void FtmSessionOver (FtmSession session);
-
-
+FtmParams ToFtmParams (const ApAct &act);
+void FtmBurst (uint32_t staId, Ptr <WifiNetDevice> device, uint32_t apId, Mac48Address apAddress);
+void FtmSessionOver (uint32_t apId, FtmSession session);
+std::string BuildIdentity ();
+std::string AttributeOverrides (int argc, char *argv[]);
+uint64_t HashString (const std::string &data, uint64_t hash);
+uint64_t HashBytes (const char *data, size_t size, uint64_t hash);
+uint64_t HashFile (const std::string &path, uint64_t hash);
+bool LoadCachedResults (const std::string &entryDir, const std::string &csvPath, const std::string &logPath,
+                        std::string &csvLine);
+void StoreCachedResults (const std::string &cacheDir, const std::string &key, const std::string &csvLine,
+                         const std::string &log);
+
+
+static uint8_t Bucket(double value, const double *edges, uint8_t nBuckets);
+static Env BuildEnv();
 static void ApplyFtmFromPython();
 static void FinalFlushToPython();
+static std::string ControlCommand(const std::string &command);
+static std::string ControlStatus();
+static std::string FlushPartialResults();
 
 
 
@@ -127,6 +1120,9 @@ std::ostringstream logOutput;
 uint64_t ftmReqSent = 0;
 uint64_t ftmReqRec = 0;
 
+std::vector<uint64_t> apFtmReqSent;
+std::vector<uint64_t> apFtmReqRec;
+
 double fuzzTime = 5.;
 double ftmIntervalTime = 1.0;
 double ftmParamsSwitch = 0.0;
@@ -148,14 +1144,26 @@ main (int argc, char *argv[])
   std::string lossModel = "LogDistance";
   std::string mobilityModel = "Distance";
   std::string pcapName = "ftm-pcap";
-
+  std::string resultCache = "";
+  std::string agentTag = "";
+  std::string traceExport = "";
+  std::string traceFile = "";
+  std::string controlSocket = "";
+  std::string warmupSnapshot = "";
+
+  uint16_t memblockKey = 2333;
   uint32_t nWifi = 1;
+  uint32_t nAp = 1;
+  double apSpacing = 30.;
+  std::string association = "RoundRobin";
+  uint32_t ftmResponders = 1;
   double distance = 10.;
   double delta = 0.;          // difference between 2 power levels in dB
   double powerInterval = 4.;  // mean (exponential) interval between power change
 
   bool ampdu = true;
   bool enableRtsCts = false;
+  bool lossCache = false;
   uint32_t packetSize = 1500;
   uint32_t dataRate = 10;
   uint32_t channelWidth = 20;
@@ -176,9 +1184,14 @@ main (int argc, char *argv[])
 
   // Parse command line arguments
   CommandLine cmd;
+  cmd.AddValue ("agentTag", "Identifier of the agent, its settings and state, part of the result cache key (required by resultCache)", agentTag);
   cmd.AddValue ("ampdu", "Use AMPDU (boolean flag)", ampdu);
+  cmd.AddValue ("apSpacing", "Distance between neighbouring APs placed along the x axis (m)", apSpacing);
   cmd.AddValue ("area", "Size of the square in which stations are wandering (m) - only for RWPM mobility type", area);
+  cmd.AddValue ("association", "Station association, fixed for the whole run (RoundRobin, Nearest) - Nearest is not available for moving RWPM stations", association);
+  cmd.AddValue ("changeEvery", "Number of FTM sessions per AP in one agent segment", g_changeEvery);
   cmd.AddValue ("channelWidth", "Channel width (MHz)", channelWidth);
+  cmd.AddValue ("controlSocket", "Unix socket path for live status queries and control commands (status, set, flush)", controlSocket);
   cmd.AddValue ("csvPath", "Path to output CSV file", csvPath);
   cmd.AddValue ("dataRate", "Traffic generator data rate (Mb/s)", dataRate);
   cmd.AddValue ("delta", "Power change (dBm)", delta);
@@ -194,6 +1207,7 @@ main (int argc, char *argv[])
   cmd.AddValue ("ftmAsap", "ASAP capable", ftmAsap);
   cmd.AddValue ("ftmFtmsPerBurst", "FTMs per burst", ftmFtmsPerBurst);
   cmd.AddValue ("ftmBurstPeriod", "Burst period", ftmBurstPeriod);
+  cmd.AddValue ("ftmResponders", "Number of nearest APs each station performs FTM with", ftmResponders);
   cmd.AddValue ("ftmParamsSwitch", "Time to switch FTM parameters (s)", ftmParamsSwitch);
   cmd.AddValue ("fuzzTime", "Maximum fuzz value (s)", fuzzTime);
   cmd.AddValue ("hiddenCrossScenario", "Flag set to enable hidden cross scenario", hiddenCrossScenario);
@@ -201,14 +1215,21 @@ main (int argc, char *argv[])
   cmd.AddValue ("logPath", "Path to log file", logPath);
   cmd.AddValue ("logInterval", "Interval between log entries (s)", logInterval);
   cmd.AddValue ("lossModel", "Propagation loss model (LogDistance, Nakagami)", lossModel);
+  cmd.AddValue ("lossCache", "Precompute path loss of static topologies - only for Distance and Hidden mobility types", lossCache);
+  cmd.AddValue ("memblockKey", "Key of the shared memory block used to exchange data with the agent", memblockKey);
   cmd.AddValue ("minGI", "Shortest guard interval (ns)", minGI);
-  cmd.AddValue ("mobilityModel", "Mobility model (Distance, RWPM, Hidden)", mobilityModel);
+  cmd.AddValue ("mobilityModel", "Mobility model (Distance, RWPM, Hidden, Trace)", mobilityModel);
   cmd.AddValue ("nodeSpeed", "Maximum station speed (m/s) - only for RWPM mobility type",nodeSpeed);
   cmd.AddValue ("nodePause","Maximum time station waits in newly selected position (s) - only for RWPM mobility type",nodePause);
+  cmd.AddValue ("nAp", "Number of APs, each with its own BSS", nAp);
   cmd.AddValue ("nWifi", "Number of stations", nWifi);
   cmd.AddValue ("packetSize", "Packets size (B)", packetSize);
   cmd.AddValue ("pcapName", "Name of a PCAP file generated from the AP", pcapName);
+  cmd.AddValue ("resultCache", "Directory of cached results, reused for identical configurations (PCAP is not cached)", resultCache);
   cmd.AddValue ("simulationTime", "Duration of simulation (s)", simulationTime);
+  cmd.AddValue ("traceExport", "Save RWPM station trajectories to a trace file and exit", traceExport);
+  cmd.AddValue ("traceFile", "Trace file with station trajectories - only for Trace mobility type", traceFile);
+  cmd.AddValue ("warmupSnapshot", "Directory of warmup state files, one per warmup: saved by a cold run; a later run with the same warmup starts fast (one warmup packet per station) and compares its state and results with the file, nothing is restored from it", warmupSnapshot);
   cmd.AddValue ("warmupTime", "Duration of warmup stage (s)", warmupTime);
   cmd.Parse (argc, argv);
 
@@ -217,6 +1238,62 @@ main (int argc, char *argv[])
       nWifi = hiddenCrossScenario ? 4 * nWifi : 2 * nWifi;
     }
 
+  if (nAp == 0 || nAp > MAX_AP_SLOTS)
+    {
+      std::cerr << "Number of APs must be between 1 and " << MAX_AP_SLOTS << "!";
+      return 3;
+    }
+
+  if (association != "RoundRobin" && association != "Nearest")
+    {
+      std::cerr << "Selected incorrect association!";
+      return 3;
+    }
+
+  // Association is static, and moving RWPM stations start at the origin with
+  // waypoints drawn only once the simulation runs
+  if (association == "Nearest" && mobilityModel == "RWPM" && nodeSpeed > 0.)
+    {
+      std::cerr << "Nearest association requires static RWPM stations (nodeSpeed=0)!";
+      return 3;
+    }
+
+  // The agent chooses the FTM parameters, the cache cannot tell agents apart on its own
+  if (!resultCache.empty () && agentTag.empty ())
+    {
+      std::cerr << "Result cache requires an agent tag (--agentTag)!";
+      return 5;
+    }
+
+  ftmResponders = std::max (1u, std::min (ftmResponders, nAp));
+
+  Ptr<MobilityTrace> mobilityTrace;
+
+  if (mobilityModel == "Trace")
+    {
+      mobilityTrace = Create<MobilityTrace> ();
+
+      if (!mobilityTrace->Open (traceFile))
+        {
+          std::cerr << "Cannot read mobility trace: " << traceFile << "!";
+          return 2;
+        }
+
+      if (mobilityTrace->GetNNodes () < nWifi)
+        {
+          std::cerr << "Mobility trace holds only " << mobilityTrace->GetNNodes () << " stations!";
+          return 2;
+        }
+
+      // Stations would stand still after the end of the trace
+      if (mobilityTrace->GetDuration () < warmupTime + simulationTime)
+        {
+          std::cerr << "Mobility trace lasts only " << mobilityTrace->GetDuration () << " s, "
+                    << warmupTime + simulationTime << " s needed!";
+          return 2;
+        }
+    }
+
   FtmParams defaultFtmParams;
   defaultFtmParams.SetNumberOfBurstsExponent(1);
   defaultFtmParams.SetBurstDuration(6);
@@ -252,12 +1329,18 @@ main (int argc, char *argv[])
             << "- AMPDU: " << ampdu << std::endl
             << "- RTS/CTS protocol enabled: " << enableRtsCts << std::endl
             << "- number of stations: " << nWifi << std::endl
+            << "- number of APs: " << nAp << std::endl
+            << "- AP spacing: " << apSpacing << " m" << std::endl
+            << "- association: " << association << std::endl
+            << "- FTM responders per station: " << ftmResponders << std::endl
             << "- simulation time: " << simulationTime << " s" << std::endl
             << "- warmup time: " << warmupTime << " s" << std::endl
             << "- max fuzz time: " << fuzzTime << " s" << std::endl
             << "- FTM params switch time: " << ftmParamsSwitch << " s" << std::endl
             << "- log interval: " << logInterval << " s" << std::endl
-            << "- loss model: " << lossModel << std::endl;
+            << "- agent segment length: " << g_changeEvery << " sessions per AP" << std::endl
+            << "- loss model: " << lossModel << std::endl
+            << "- loss cache: " << lossCache << std::endl;
 
   if (mobilityModel == "Distance" || mobilityModel == "Hidden")
     {
@@ -273,6 +1356,13 @@ main (int argc, char *argv[])
                 << "- max node pause: " << nodePause << " s" << std::endl
                 << std::endl;
     }
+  else if (mobilityModel == "Trace")
+    {
+      std::cout << "- mobility model: " << mobilityModel << std::endl
+                << "- trace file: " << traceFile << std::endl
+                << "- max node speed: " << mobilityTrace->GetMaxSpeed () << " m/s" << std::endl
+                << std::endl;
+    }
 
   std::cout << "FTM user parameters:" << std::endl
             << "- number of bursts exponent: " << (uint32_t) ftmNumberOfBurstsExponent << std::endl
@@ -310,24 +1400,137 @@ main (int argc, char *argv[])
   //   }
 
 
-  int memblock_key = 2333;
-  static FTMControl ftm(memblock_key);
+  // Generator mode: only the stations move, no network and no agent
+  if (!traceExport.empty ())
+    {
+      return ExportMobilityTrace (traceExport, nWifi, area, nodeSpeed, nodePause) ? 0 : 2;
+    }
+
+  static FTMControl ftm(memblockKey);
   g_ftmCtrl = &ftm;
 
+  // Key the result cache with every setting which affects the results, output paths excluded.
+  // Keep in sync with the command line arguments above. Settings which affect the network
+  // before the end of warmup also key the warmup snapshot, as do the --ns3::* attribute and
+  // global value overrides, which are not listed above.
+  std::string cacheKey;
+  std::string runKey;
+
+  if (!resultCache.empty () || !warmupSnapshot.empty ())
+    {
+      std::ostringstream warmupConfig;
+      warmupConfig << std::setprecision (17) << "ampdu=" << ampdu << ";area=" << area
+                   << ";channelWidth=" << channelWidth << ";delta=" << delta
+                   << ";distance=" << distance << ";enableRtsCts=" << enableRtsCts << ";fuzzTime=" << fuzzTime
+                   << ";hiddenCrossScenario=" << hiddenCrossScenario << ";lossModel=" << lossModel
+                   << ";lossCache=" << lossCache << ";minGI=" << minGI << ";mobilityModel=" << mobilityModel
+                   << ";nodeSpeed=" << nodeSpeed << ";nodePause=" << nodePause << ";nWifi=" << nWifi
+                   << ";nAp=" << nAp << ";apSpacing=" << apSpacing << ";association=" << association
+                   << ";packetSize=" << packetSize << ";warmupTime=" << warmupTime << ";trace="
+                   << (mobilityTrace ? HashBytes (mobilityTrace->GetData (), mobilityTrace->GetSize (), 14695981039346656037ULL) : 0)
+                   << ";seed=" << RngSeedManager::GetSeed ()
+                   << ";run=" << RngSeedManager::GetRun () << ";build=" << BuildIdentity ()
+                   << ";overrides=" << AttributeOverrides (argc, argv);
+
+      std::ostringstream config;
+      config << std::setprecision (17) << warmupConfig.str () << ";agentTag=" << agentTag
+             << ";ftmIntervalTime=" << ftmIntervalTime << ";ftmMap="
+             << (ftmMapPath.empty () ? 0 : HashFile (ftmMapPath, 14695981039346656037ULL))
+             << ";ftmNumberOfBurstsExponent=" << (uint32_t) ftmNumberOfBurstsExponent
+             << ";ftmBurstDuration=" << (uint32_t) ftmBurstDuration
+             << ";ftmMinDeltaFtm=" << (uint32_t) ftmMinDeltaFtm << ";ftmPartialTsfTimer=" << ftmPartialTsfTimer
+             << ";ftmPartialTsfNoPref=" << ftmPartialTsfNoPref << ";ftmAsap=" << ftmAsap
+             << ";ftmFtmsPerBurst=" << (uint32_t) ftmFtmsPerBurst << ";ftmBurstPeriod=" << ftmBurstPeriod
+             << ";ftmParamsSwitch=" << ftmParamsSwitch << ";powerInterval=" << powerInterval
+             << ";logInterval=" << logInterval << ";ftmResponders=" << ftmResponders
+             << ";simulationTime=" << simulationTime << ";changeEvery=" << g_changeEvery
+             << ";dataRate=" << dataRate; // warmup traffic does not depend on it
+
+      std::ostringstream warmupKey, key;
+      warmupKey << std::hex << std::setw (16) << std::setfill ('0')
+                << HashString (warmupConfig.str (), 14695981039346656037ULL);
+      key << std::hex << std::setw (16) << std::setfill ('0')
+          << HashString (config.str (), 14695981039346656037ULL);
+      runKey = key.str ();
+      cacheKey = runKey;
+
+      // Start from the snapshot of a cold run with the same warmup, or save one. Snapshots
+      // are named by their warmup key, so runs with other warmups never overwrite them.
+      if (!warmupSnapshot.empty ())
+        {
+          ns3::SystemPath::MakeDirectories (warmupSnapshot);
+          g_warmupSnapshotPath = warmupSnapshot + "/" + warmupKey.str ();
+          g_warmupFast = g_warmupSnapshot.Load (g_warmupSnapshotPath) && g_warmupSnapshot.key == warmupKey.str ();
+
+          if (g_warmupFast)
+            {
+              Config::SetDefault ("StaTrafficApplication::WarmupPackets", UintegerValue (1));
+              cacheKey = runKey + "-fast";
+              std::cout << "Fast warmup, compared with the snapshot: " << g_warmupSnapshotPath << std::endl;
+            }
+          else
+            {
+              g_warmupSnapshot = WarmupSnapshot ();
+              g_warmupSnapshot.key = warmupKey.str ();
+              std::cout << "Cold warmup, saved to the snapshot: " << g_warmupSnapshotPath << std::endl;
+            }
+        }
+    }
+
+  if (!resultCache.empty ())
+    {
+      std::string csvLine;
+      if (LoadCachedResults (resultCache + "/" + cacheKey, csvPath, logPath, csvLine))
+        {
+          std::cout << "Results found in cache: " << resultCache << "/" << cacheKey << std::endl
+                    << "mobility,velocity,distance,nWifi,nWifiReal,seed,throughput,ftmSuccessRate"
+                    << std::endl
+                    << csvLine << std::endl
+                    << std::endl
+                    << "Simulation data saved to: " << csvPath << std::endl
+                    << "Log data saved to: " << logPath << std::endl;
+
+          Simulator::Destroy ();
+          return 0;
+        }
+    }
+
   SetFtmParams(defaultFtmParams);
 
+  ApAct defaultApAct = {1, 6, 4, 0, true, true, 2, 2, true};
+  g_apParams.assign (nAp, defaultApAct);
+  g_apFtmParams.assign (nAp, defaultFtmParams);
+  g_sessionsTotal.assign (nAp, 0);
+  g_sessionsOk.assign (nAp, 0);
+  apFtmReqSent.assign (nAp, 0);
+  apFtmReqRec.assign (nAp, 0);
+
   // double stopTime = warmupTime + simulationTime;
   // Simulator::Schedule(Seconds(warmupTime + 0.1), &UpdateFtmParams, &ftm, stopTime);
 
   Simulator::Schedule(Seconds(warmupTime + simulationTime - 1e-5), &FinalFlushToPython);
 
 
-  // Create AP and stations
-  NodeContainer wifiApNode (1);
+  // Time every setup stage to keep startup a small fraction of the run
+  std::vector<std::pair<std::string, double>> setupStages;
+  auto stageStart = std::chrono::high_resolution_clock::now ();
+  auto setupStart = stageStart;
+
+  auto markSetupStage = [&setupStages, &stageStart] (const std::string &stage) {
+    auto now = std::chrono::high_resolution_clock::now ();
+    std::chrono::duration<double> stageTime = now - stageStart;
+    setupStages.push_back (std::make_pair (stage, stageTime.count ()));
+    stageStart = now;
+  };
+
+  // Create APs and stations, station i is placed in the BSS i % nAp
+  NodeContainer wifiApNode (nAp);
   NodeContainer wifiStaNodes (nWifi);
 
-  // Configure mobility
+  // Configure mobility, stations which move away from their setup position
+  // before the traffic starts are associated by staPositions
   MobilityHelper mobility;
+  std::vector<Vector> staPositions;
 
   if (mobilityModel == "Distance")
     {
@@ -335,9 +1538,18 @@ main (int argc, char *argv[])
       mobility.Install (wifiApNode);
       mobility.Install (wifiStaNodes);
 
-      // Place AP at (distance, 0)
-      Ptr<MobilityModel> mobilityAp = wifiApNode.Get (0)->GetObject<MobilityModel> ();
-      mobilityAp->SetPosition (Vector3D (distance, 0., 0.));
+      // Place AP k at (k * apSpacing + distance, 0) and its stations at (k * apSpacing, 0)
+      for (uint32_t k = 0; k < nAp; ++k)
+        {
+          Ptr<MobilityModel> mobilityAp = wifiApNode.Get (k)->GetObject<MobilityModel> ();
+          mobilityAp->SetPosition (Vector3D (k * apSpacing + distance, 0., 0.));
+        }
+
+      for (uint32_t i = 0; i < nWifi; ++i)
+        {
+          Ptr<MobilityModel> mobilityStation = wifiStaNodes.Get (i)->GetObject<MobilityModel> ();
+          mobilityStation->SetPosition (Vector3D ((i % nAp) * apSpacing, 0., 0.));
+        }
     }
   else if (mobilityModel == "Hidden")
     {
@@ -345,65 +1557,62 @@ main (int argc, char *argv[])
       mobility.Install (wifiApNode);
       mobility.Install (wifiStaNodes);
 
-      // Place AP at (0, 0)
-      Ptr<MobilityModel> mobilityAp = wifiApNode.Get (0)->GetObject<MobilityModel> ();
-      mobilityAp->SetPosition (Vector3D (0., 0., 0.));
+      // Place AP k at (k * apSpacing, 0)
+      for (uint32_t k = 0; k < nAp; ++k)
+        {
+          Ptr<MobilityModel> mobilityAp = wifiApNode.Get (k)->GetObject<MobilityModel> ();
+          mobilityAp->SetPosition (Vector3D (k * apSpacing, 0., 0.));
+        }
 
-      // Place Stations on both sides of AP, in (-distance, 0) and (distance, 0)
+      // Place Stations on both sides of their AP, in (-distance, 0) and (distance, 0)
       int orientation_x = 0;
       int orientation_y = 0;
       Ptr<MobilityModel> mobilityStation;
-      for (int i = 0; i < nWifi; i++)
+      for (uint32_t i = 0; i < nWifi; i++)
         {
+          uint32_t j = i / nAp; // index of the station in its BSS
+
           if (hiddenCrossScenario)
             {
-              orientation_y = i % 4 < 2 ? 1 : -1;
+              orientation_y = j % 4 < 2 ? 1 : -1;
             }
-          orientation_x = i % 2 == 0 ? 1 : -1;
+          orientation_x = j % 2 == 0 ? 1 : -1;
           mobilityStation = wifiStaNodes.Get (i)->GetObject<MobilityModel> ();
-          mobilityStation->SetPosition (Vector3D (orientation_x * distance, orientation_y * distance, 0.));
+          mobilityStation->SetPosition (Vector3D ((i % nAp) * apSpacing + orientation_x * distance,
+                                                  orientation_y * distance, 0.));
         }
     }
   else if (mobilityModel == "RWPM")
     {
-      // Place AP at (0, 0)
+      // Place AP k at (k * apSpacing, 0)
       mobility.SetMobilityModel ("ns3::ConstantVelocityMobilityModel");
       mobility.Install (wifiApNode);
 
-      // Place nodes randomly in square extending from (0, 0) to (area, area)
-      ObjectFactory pos;
-      pos.SetTypeId ("ns3::RandomRectanglePositionAllocator");
-      std::stringstream ssArea;
-      ssArea << "ns3::UniformRandomVariable[Min=0.0|Max=" << area;
-      pos.Set ("X", StringValue (ssArea.str () + "|Stream=2]"));
-      pos.Set ("Y", StringValue (ssArea.str () + "|Stream=3]"));
-
-      Ptr<PositionAllocator> taPositionAlloc = pos.Create ()->GetObject<PositionAllocator> ();
-      mobility.SetPositionAllocator (taPositionAlloc);
-
-      // Set random pause (from 0 to nodePause [s]) and speed (from 0 to nodeSpeed [m/s])
-      std::stringstream ssSpeed;
-      ssSpeed << "ns3::UniformRandomVariable[Min=0.0|Max=" << nodeSpeed << "|Stream=4]";
-      std::stringstream ssPause;
-      ssPause << "ns3::UniformRandomVariable[Min=0.0|Max=" << nodePause << "|Stream=5]";
-
-      mobility.SetMobilityModel ("ns3::RandomWaypointMobilityModel",
-                                 "Speed", StringValue (ssSpeed.str ()),
-                                 "Pause", StringValue (ssPause.str ()),
-                                 "PositionAllocator", PointerValue (taPositionAlloc));
+      for (uint32_t k = 0; k < nAp; ++k)
+        {
+          wifiApNode.Get (k)->GetObject<MobilityModel> ()->SetPosition (Vector3D (k * apSpacing, 0., 0.));
+        }
 
-      mobility.Install (wifiStaNodes);
+      staPositions = InstallRandomWaypoint (wifiStaNodes, area, nodeSpeed, nodePause);
+    }
+  else if (mobilityModel == "Trace")
+    {
+      // Place AP k at (k * apSpacing, 0), stations replay their trajectories
+      mobility.SetMobilityModel ("ns3::ConstantPositionMobilityModel");
+      mobility.Install (wifiApNode);
 
-      for (uint32_t j = 0; j < wifiStaNodes.GetN (); ++j)
+      for (uint32_t k = 0; k < nAp; ++k)
         {
-          Ptr<MobilityModel> mobilityModel = wifiStaNodes.Get (j)->GetObject<MobilityModel> ();
-
-          if (nodeSpeed == 0.)
-            {
-              Simulator::Schedule (Seconds (fuzzTime), &SetPosition, mobilityModel, mobilityModel->GetPosition ());
-            }
+          wifiApNode.Get (k)->GetObject<MobilityModel> ()->SetPosition (Vector3D (k * apSpacing, 0., 0.));
+        }
 
-          mobilityModel->SetPosition (Vector3D (0., 0., 0.));
+      // Not through MobilityHelper, it would set initial positions
+      for (uint32_t j = 0; j < nWifi; ++j)
+        {
+          Ptr<TraceMobilityModel> model = CreateObject<TraceMobilityModel> ();
+          model->SetTrace (mobilityTrace, j);
+          wifiStaNodes.Get (j)->AggregateObject (model);
+          staPositions.push_back (mobilityTrace->GetFirstWaypoint (j));
         }
     }
   else
@@ -412,41 +1621,111 @@ main (int argc, char *argv[])
       return 2;
     }
 
+  // Associate stations and choose the APs they perform FTM with, own AP first
+  std::vector<uint32_t> staAp (nWifi);
+  std::vector<std::vector<uint32_t>> staResponders (nWifi);
+  g_apStations.assign (nAp, 0);
+
+  for (uint32_t i = 0; i < nWifi; ++i)
+    {
+      Vector staPosition = staPositions.empty () ? wifiStaNodes.Get (i)->GetObject<MobilityModel> ()->GetPosition ()
+                                                 : staPositions[i];
+      std::vector<std::pair<double, uint32_t>> apDistances;
+
+      for (uint32_t k = 0; k < nAp; ++k)
+        {
+          Ptr<MobilityModel> mobilityAp = wifiApNode.Get (k)->GetObject<MobilityModel> ();
+          apDistances.push_back (std::make_pair (CalculateDistance (staPosition, mobilityAp->GetPosition ()), k));
+        }
+
+      std::stable_sort (apDistances.begin (), apDistances.end ());
+      staAp[i] = association == "Nearest" ? apDistances[0].second : i % nAp;
+      g_apStations[staAp[i]]++;
+
+      staResponders[i].push_back (staAp[i]);
+      for (uint32_t k = 0; k < nAp && staResponders[i].size () < ftmResponders; ++k)
+        {
+          if (apDistances[k].second != staAp[i])
+            {
+              staResponders[i].push_back (apDistances[k].second);
+            }
+        }
+    }
+
+  markSetupStage ("mobility");
+
   // Print position of each node
   std::cout << "Node positions:" << std::endl;
 
-  // AP position
-  Ptr<MobilityModel> position = wifiApNode.Get (0)->GetObject<MobilityModel> ();
-  Vector pos = position->GetPosition ();
-  std::cout << "AP:\tx=" << pos.x << ", y=" << pos.y << std::endl;
+  // APs positions
+  Ptr<MobilityModel> position;
+  Vector pos;
+
+  for (uint32_t k = 0; k < nAp; ++k)
+    {
+      position = wifiApNode.Get (k)->GetObject<MobilityModel> ();
+      pos = position->GetPosition ();
+      std::cout << "AP " << k << ":\tx=" << pos.x << ", y=" << pos.y << std::endl;
+    }
 
   // Stations positions
   for (auto node = wifiStaNodes.Begin (); node != wifiStaNodes.End (); ++node)
     {
       position = (*node)->GetObject<MobilityModel> ();
       pos = position->GetPosition ();
-      std::cout << "Sta " << (*node)->GetId () << ":\tx=" << pos.x << ", y=" << pos.y << std::endl;
+      std::cout << "Sta " << (*node)->GetId () << ":\tx=" << pos.x << ", y=" << pos.y
+                << "\tAP " << staAp[node - wifiStaNodes.Begin ()] << std::endl;
     }
 
   std::cout << std::endl;
 
   // Configure wireless channel
   YansWifiPhyHelper phy;
-  YansWifiChannelHelper channelHelper = YansWifiChannelHelper::Default ();
 
-  if (lossModel == "Nakagami")
+  if (lossModel != "LogDistance" && lossModel != "Nakagami")
     {
-      // Add Nakagami fading to the default log distance model
-      channelHelper.AddPropagationLoss ("ns3::NakagamiPropagationLossModel");
+      std::cerr << "Selected incorrect loss model!";
+      return 1;
     }
-  else if (lossModel != "LogDistance")
+
+  if (lossCache && (mobilityModel == "RWPM" || mobilityModel == "Trace"))
     {
-      std::cerr << "Selected incorrect loss model!";
+      std::cerr << "Loss cache requires a static mobility model!";
       return 1;
     }
 
+  if (lossCache)
+    {
+      // Same models as YansWifiChannelHelper::Default, with the log distance
+      // loss of every node pair computed once for the fixed positions above
+      Ptr<StaticPathLossCache> cache = CreateObject<StaticPathLossCache> ();
+      cache->Build (NodeContainer (wifiApNode, wifiStaNodes), CreateObject<LogDistancePropagationLossModel> ());
+
+      if (lossModel == "Nakagami")
+        {
+          cache->SetFading (CreateObject<NakagamiPropagationLossModel> ());
+        }
+
+      Ptr<YansWifiChannel> channel = CreateObject<YansWifiChannel> ();
+      channel->SetPropagationDelayModel (CreateObject<ConstantSpeedPropagationDelayModel> ());
+      channel->SetPropagationLossModel (cache);
+      phy.SetChannel (channel);
+    }
+  else
+    {
+      YansWifiChannelHelper channelHelper = YansWifiChannelHelper::Default ();
+
+      if (lossModel == "Nakagami")
+        {
+          // Add Nakagami fading to the default log distance model
+          channelHelper.AddPropagationLoss ("ns3::NakagamiPropagationLossModel");
+        }
+
+      phy.SetChannel (channelHelper.Create ());
+    }
+
   phy.Set ("ChannelWidth", UintegerValue (channelWidth));
-  phy.SetChannel (channelHelper.Create ());
+  markSetupStage ("channel");
 
   // Configure two power levels
   phy.Set ("TxPowerLevels", UintegerValue (2));
@@ -466,66 +1745,98 @@ main (int argc, char *argv[])
   UintegerValue ctsThr = (enableRtsCts ? UintegerValue (ctsThrLow) : UintegerValue (ctsThrHigh));
   Config::SetDefault ("ns3::WifiRemoteStationManager::RtsCtsThreshold", ctsThr);
 
-  // Set SSID
-  Ssid ssid = Ssid ("ns3-80211ax");
-  mac.SetType ("ns3::StaWifiMac", "Ssid", SsidValue (ssid), "MaxMissedBeacons",
-               UintegerValue (1000)); // prevents exhaustion of association IDs
+  // Set SSID of every BSS
+  std::vector<Ssid> ssids;
+
+  for (uint32_t k = 0; k < nAp; ++k)
+    {
+      ssids.push_back (Ssid (nAp == 1 ? "ns3-80211ax" : "ns3-80211ax-" + std::to_string (k)));
+    }
 
-  // Create and configure Wi-Fi interfaces
+  // Create and configure Wi-Fi interfaces, stations join the BSS of their AP
   NetDeviceContainer staDevice;
-  staDevice = wifi.Install (phy, mac, wifiStaNodes);
 
-  mac.SetType ("ns3::ApWifiMac", "Ssid", SsidValue (ssid));
+  for (uint32_t i = 0; i < nWifi; ++i)
+    {
+      mac.SetType ("ns3::StaWifiMac", "Ssid", SsidValue (ssids[staAp[i]]), "MaxMissedBeacons",
+                   UintegerValue (1000)); // prevents exhaustion of association IDs
+      staDevice.Add (wifi.Install (phy, mac, wifiStaNodes.Get (i)));
+    }
 
   NetDeviceContainer apDevice;
-  apDevice = wifi.Install (phy, mac, wifiApNode);
-  
-  // Manage AMPDU aggregation
-  if (!ampdu)
+
+  for (uint32_t k = 0; k < nAp; ++k)
     {
-      Config::Set ("/NodeList/*/DeviceList/*/$ns3::WifiNetDevice/Mac/BE_MaxAmpduSize",
-                   UintegerValue (0));
+      mac.SetType ("ns3::ApWifiMac", "Ssid", SsidValue (ssids[k]));
+      apDevice.Add (wifi.Install (phy, mac, wifiApNode.Get (k)));
+    }
+
+  // Configure devices directly, "/NodeList/*" paths resolve over all nodes
+  NetDeviceContainer wifiDevices (apDevice, staDevice);
+
+  for (auto device = wifiDevices.Begin (); device != wifiDevices.End (); ++device)
+    {
+      Ptr<WifiNetDevice> wifiDevice = DynamicCast<WifiNetDevice> (*device);
+
+      // Manage AMPDU aggregation
+      if (!ampdu)
+        {
+          wifiDevice->GetMac ()->SetAttribute ("BE_MaxAmpduSize", UintegerValue (0));
+        }
+
+      // Set shortest GI
+      wifiDevice->GetHeConfiguration ()->SetGuardInterval (NanoSeconds (minGI));
     }
 
-  // Set shortest GI
-  Config::Set ("/NodeList/*/DeviceList/*/$ns3::WifiNetDevice/HeConfiguration/GuardInterval",
-               TimeValue (NanoSeconds (minGI)));
+  markSetupStage ("devices");
 
   // Install an Internet stack
   InternetStackHelper stack;
   stack.Install (wifiApNode);
   stack.Install (wifiStaNodes);
 
-  // Configure IP addressing
-  Ipv4AddressHelper address ("192.168.1.0", "255.255.255.0");
+  // Configure IP addressing, a /16 keeps the station addresses contiguous
+  // (ApTrafficSink maps them to station IDs) for more than 253 nodes
+  Ipv4AddressHelper address ("10.1.0.0", "255.255.0.0");
   Ipv4InterfaceContainer staNodeInterface = address.Assign (staDevice);
   Ipv4InterfaceContainer apNodeInterface = address.Assign (apDevice);
+  markSetupStage ("internet");
 
   // PopulateArpCache
   PopulateArpCache ();
+  markSetupStage ("arp");
 
-  // Configure applications
-  DataRate applicationDataRate = DataRate (0.1 * 1e6);
+  // Configure applications, one source per station switching from the warmup rate
+  // at warmupTime, and one sink per AP counting bytes of every station
+  DataRate warmupDataRate = DataRate (0.1 * 1e6);
+  DataRate applicationDataRate = DataRate (dataRate * 1e6 / nWifi);
   uint32_t portNumber = 9;
 
-  for (uint32_t j = 0; j < wifiStaNodes.GetN (); ++j)
+  std::vector<Ptr<ApTrafficSink>> sinks;
+
+  for (uint32_t k = 0; k < nAp; ++k)
     {
-      InstallTrafficGenerator (wifiStaNodes.Get (j), wifiApNode.Get (0), portNumber++,
-                               applicationDataRate, packetSize, 0., warmupTime);
+      Ptr<ApTrafficSink> sink = CreateObject<ApTrafficSink> ();
+      sink->Setup (portNumber, staNodeInterface.GetAddress (0), nWifi);
+      wifiApNode.Get (k)->AddApplication (sink);
+      sink->SetStartTime (Seconds (0.));
+      sink->SetStopTime (Seconds (warmupTime + simulationTime));
+      sinks.push_back (sink);
     }
 
-  applicationDataRate = DataRate (dataRate * 1e6 / nWifi);
-
   for (uint32_t j = 0; j < wifiStaNodes.GetN (); ++j)
     {
-      InstallTrafficGenerator (wifiStaNodes.Get (j), wifiApNode.Get (0), portNumber++,
-                               applicationDataRate, packetSize, warmupTime, warmupTime + simulationTime);
+      InstallTrafficGenerator (wifiStaNodes.Get (j), wifiApNode.Get (staAp[j]), portNumber,
+                               warmupDataRate, applicationDataRate, packetSize, warmupTime + simulationTime);
     }
 
-  // Install FlowMonitor
-  FlowMonitorHelper flowmon;
-  Ptr<FlowMonitor> monitor = flowmon.InstallAll ();
-  Simulator::Schedule (Seconds (warmupTime), &GetWarmupFlows, monitor);
+  Simulator::Schedule (Seconds (warmupTime), &GetWarmupFlows, sinks, nWifi);
+
+  if (!warmupSnapshot.empty ())
+    {
+      Simulator::Schedule (Seconds (warmupTime), &WarmupEnd, staDevice);
+    }
+  markSetupStage ("applications");
 
 
 
@@ -557,7 +1868,8 @@ main (int argc, char *argv[])
     while (time < simulationTime)
     {
       time += x->GetValue ();
-      Simulator::Schedule (Seconds (time), &ChangePower, wifiStaNodes.Get (j), maxPower);
+      Simulator::Schedule (Seconds (time), &ChangePower, j,
+                           DynamicCast<WifiNetDevice> (staDevice.Get (j)), maxPower);
       maxPower = !maxPower;
     }
   }
@@ -570,30 +1882,102 @@ main (int argc, char *argv[])
 
   for (uint32_t j = 0; j < wifiStaNodes.GetN (); ++j)
     {
-      Simulator::Schedule (Seconds (warmupTime + offset->GetValue ()), &FtmBurst, j,
-                           staDevice.Get (j)->GetObject<WifiNetDevice>(),
-                           Mac48Address::ConvertFrom (apDevice.Get (0)->GetAddress ()));
+      for (uint32_t k : staResponders[j])
+        {
+          Simulator::Schedule (Seconds (warmupTime + offset->GetValue ()), &FtmBurst, j,
+                               staDevice.Get (j)->GetObject<WifiNetDevice>(), k,
+                               Mac48Address::ConvertFrom (apDevice.Get (k)->GetAddress ()));
+        }
+    }
+
+  // State used for the context of every segment reported to the agent
+  g_staAp = staAp;
+  g_staHighPower.assign (nWifi, false);
+  g_apSinks = sinks;
+  g_segmentStart.assign (nAp, Seconds (warmupTime));
+  g_segmentRxBytes.assign (nAp, 0);
+  g_staMobility.clear ();
+  g_apMobility.clear ();
+
+  for (uint32_t j = 0; j < nWifi; ++j)
+    {
+      g_staMobility.push_back (wifiStaNodes.Get (j)->GetObject<MobilityModel> ());
+    }
+
+  for (uint32_t k = 0; k < nAp; ++k)
+    {
+      g_apMobility.push_back (wifiApNode.Get (k)->GetObject<MobilityModel> ());
+    }
+
+  // Offered load of every BSS reported to the agent
+  g_apDataRate.assign (nAp, 0);
+
+  for (uint32_t k = 0; k < nAp; ++k)
+    {
+      g_apDataRate[k] = std::round (dataRate * g_apStations[k] / (double) nWifi);
+    }
+
+  // Log FTM success rate, per AP if there are several
+  logOutput << "time,ftmSuccessRate";
+
+  for (uint32_t k = 0; nAp > 1 && k < nAp; ++k)
+    {
+      logOutput << ",ftmSuccessRateAp" << k;
     }
 
-  // Log FTM success rate
-  logOutput << "time,ftmSuccessRate" << std::endl;
+  logOutput << std::endl;
   Simulator::Schedule (Seconds (warmupTime), &LogSuccessRate);
 
   // Define simulation stop time
   Simulator::Stop (Seconds (warmupTime + simulationTime));
 
+  markSetupStage ("schedule");
+
+  // Print setup time of each stage
+  std::chrono::duration<double> setupTime = std::chrono::high_resolution_clock::now () - setupStart;
+  std::cout << "Setup time per stage:" << std::endl;
+
+  for (auto &stage : setupStages)
+    {
+      std::cout << "- " << stage.first << ": " << stage.second << " s" << std::endl;
+    }
+
+  std::cout << "- total: " << setupTime.count () << " s" << std::endl
+            << std::endl;
+
+  // Serve status queries and control commands during the run
+  ControlSocket control;
+  g_csvPath = csvPath;
+  g_logPath = logPath;
+  g_runStart = std::chrono::steady_clock::now ();
+
+  if (!controlSocket.empty ())
+    {
+      if (!control.Start (controlSocket, &ControlCommand))
+        {
+          std::cerr << "Cannot open control socket: " << controlSocket << "!";
+          return 4;
+        }
+
+      std::cout << "Control socket: " << controlSocket << std::endl;
+    }
+
   // Record start time
   std::cout << "Starting simulation..." << std::endl;
   auto start = std::chrono::high_resolution_clock::now ();
 
   Simulator::Run ();
 
+  control.Stop ();
+
   // Record stop time and count duration
   auto finish = std::chrono::high_resolution_clock::now ();
   std::chrono::duration<double> elapsed = finish - start;
 
   std::cout << "Done!" << std::endl
             << "Elapsed time: " << elapsed.count () << " s" << std::endl
+            << "Setup time: " << setupTime.count () << " s ("
+            << 100. * setupTime.count () / elapsed.count () << "% of run)" << std::endl
             << std::endl;
 
   // Calculate per-flow throughput and Jain's fairness index
@@ -601,20 +1985,11 @@ main (int argc, char *argv[])
   double jainsIndexN = 0.;
   double jainsIndexD = 0.;
 
-  Ptr<Ipv4FlowClassifier> classifier = DynamicCast<Ipv4FlowClassifier> (flowmon.GetClassifier ());
-  std::map<FlowId, FlowMonitor::FlowStats> stats = monitor->GetFlowStats ();
   std::cout << "Results: " << std::endl;
 
-  for (auto &stat : stats)
+  for (uint32_t j = 0; j < wifiStaNodes.GetN (); ++j)
     {
-      Ipv4FlowClassifier::FiveTuple t = classifier->FindFlow (stat.first);
-
-      if (t.destinationPort < 9 + wifiStaNodes.GetN ())
-        {
-          continue;
-        }
-
-      double flow = (8 * stat.second.rxBytes - warmupFlows[stat.first]) / (1e6 * simulationTime);
+      double flow = (8 * sinks[staAp[j]]->GetRxBytes (j) - warmupFlows[j]) / (1e6 * simulationTime);
 
       if (flow > dataRate / (50 * nWifi))
         {
@@ -623,8 +1998,8 @@ main (int argc, char *argv[])
           jainsIndexD += flow * flow;
         }
 
-      std::cout << "Flow " << stat.first << " (" << t.sourceAddress << " -> "
-                << t.destinationAddress << ")\tThroughput: " << flow << " Mb/s" << std::endl;
+      std::cout << "Flow " << j + 1 << " (" << staNodeInterface.GetAddress (j) << " -> "
+                << apNodeInterface.GetAddress (staAp[j]) << ")\tThroughput: " << flow << " Mb/s" << std::endl;
     }
 
   double totalThr = jainsIndexN;
@@ -636,8 +2011,19 @@ main (int argc, char *argv[])
             << "Jain's fairness index: " << fairnessIndex << std::endl
             << std::endl;
 
+  if (nAp > 1)
+    {
+      for (uint32_t k = 0; k < nAp; ++k)
+        {
+          std::cout << "AP " << k << " (" << g_apStations[k] << " stations)\tFTM success rate: "
+                    << apFtmReqRec[k] / (double) apFtmReqSent[k] << std::endl;
+        }
+
+      std::cout << std::endl;
+    }
+
   // Gather results in CSV format
-  double velocity = mobilityModel == "RWPM" ? nodeSpeed : 0.;
+  double velocity = mobilityModel == "RWPM" ? nodeSpeed : mobilityTrace ? mobilityTrace->GetMaxSpeed () : 0.;
   double ftmSuccessRate = ftmReqRec / (double) ftmReqSent;
 
   std::ostringstream csvOutput;
@@ -658,6 +2044,31 @@ main (int argc, char *argv[])
   logFile << logOutput.str ();
   std::cout << "Log data saved to: " << logPath << std::endl;
 
+  if (!resultCache.empty () && !g_controlSteered)
+    {
+      StoreCachedResults (resultCache, cacheKey, csvOutput.str (), logOutput.str ());
+    }
+
+  // The cold run saves its results with the snapshot, a fast run of the same configuration compares
+  if (!warmupSnapshot.empty () && !g_warmupFast)
+    {
+      g_warmupSnapshot.resultsKey = runKey;
+      g_warmupSnapshot.throughput = totalThr;
+      g_warmupSnapshot.ftmSuccessRate = ftmSuccessRate;
+      g_warmupSnapshot.Save (g_warmupSnapshotPath);
+      std::cout << "Warmup snapshot saved to: " << g_warmupSnapshotPath << std::endl;
+    }
+  else if (g_warmupFast && g_warmupSnapshot.resultsKey == runKey)
+    {
+      std::cout << std::endl
+                << "Results vs cold run:" << std::endl
+                << "- throughput: " << totalThr << " Mb/s (cold " << g_warmupSnapshot.throughput << " Mb/s, "
+                << 100. * (totalThr - g_warmupSnapshot.throughput) / g_warmupSnapshot.throughput << "%)"
+                << std::endl
+                << "- FTM success rate: " << ftmSuccessRate << " (cold " << g_warmupSnapshot.ftmSuccessRate
+                << ", difference " << ftmSuccessRate - g_warmupSnapshot.ftmSuccessRate << ")" << std::endl;
+    }
+
   //Clean-up
   Simulator::Destroy ();
 
@@ -667,26 +2078,100 @@ main (int argc, char *argv[])
 /***** Function definitions *****/
 
 void
-ChangePower (Ptr<Node> staNode, uint8_t powerLevel)
+ChangePower (uint32_t staId, Ptr<WifiNetDevice> staDevice, uint8_t powerLevel)
 {
   // Change power in STA
-  Config::Set ("/NodeList/" + std::to_string (staNode->GetId ()) +
-                   "/DeviceList/*/$ns3::WifiNetDevice/RemoteStationManager/DefaultTxPowerLevel",
-               UintegerValue (powerLevel));
+  staDevice->GetRemoteStationManager ()->SetAttribute ("DefaultTxPowerLevel", UintegerValue (powerLevel));
+  g_staHighPower[staId] = powerLevel > 0;
+}
+
+void
+GetWarmupFlows (std::vector<Ptr<ApTrafficSink>> sinks, uint32_t nStations)
+{
+  for (uint32_t j = 0; j < nStations; ++j)
+    {
+      uint64_t rxBytes = 0;
+
+      for (auto &sink : sinks)
+        {
+          rxBytes += sink->GetRxBytes (j);
+        }
+
+      warmupFlows.insert (std::pair<uint32_t, uint64_t> (j, 8 * rxBytes));
+    }
+
+  // First segment load is measured from the end of warmup
+  for (uint32_t k = 0; k < sinks.size (); ++k)
+    {
+      g_segmentStart[k] = Simulator::Now ();
+      g_segmentRxBytes[k] = sinks[k]->GetTotalRxBytes ();
+    }
 }
 
 void
-GetWarmupFlows (Ptr<FlowMonitor> monitor)
+WarmupEnd (NetDeviceContainer staDevices)
 {
-  for (auto &stat : monitor->GetFlowStats ())
+  std::chrono::duration<double> wallTime = std::chrono::steady_clock::now () - g_runStart;
+
+  WarmupSnapshot state;
+  state.wallTime = wallTime.count ();
+
+  for (uint32_t j = 0; j < staDevices.GetN (); ++j)
+    {
+      Ptr<StaWifiMac> mac = DynamicCast<StaWifiMac> (DynamicCast<WifiNetDevice> (staDevices.Get (j))->GetMac ());
+      PointerValue txop;
+      mac->GetAttribute ("BE_Txop", txop);
+      Ptr<WifiMacQueue> queue = txop.Get<QosTxop> ()->GetWifiMacQueue ();
+      Vector pos = g_staMobility[j]->GetPosition ();
+
+      state.stations.push_back ({warmupFlows[j], pos.x, pos.y, mac->IsAssociated (), queue->GetNPackets (),
+                                 queue->GetNBytes ()});
+    }
+
+  if (!g_warmupFast)
+    {
+      state.key = g_warmupSnapshot.key;
+      g_warmupSnapshot = state;
+      g_warmupSnapshot.Save (g_warmupSnapshotPath);
+      return;
+    }
+
+  // Compare the fast start with the cold run
+  const std::vector<WarmupStation> &cold = g_warmupSnapshot.stations;
+  uint32_t n = std::min (cold.size (), state.stations.size ());
+  uint32_t associatedFast = 0, associatedCold = 0, associationMismatch = 0;
+  uint64_t queuedFast = 0, queuedCold = 0, bitsFast = 0, bitsCold = 0;
+  double maxPositionDiff = 0.;
+
+  for (uint32_t j = 0; j < n; ++j)
     {
-      warmupFlows.insert (std::pair<uint32_t, double> (stat.first, 8 * stat.second.rxBytes));
+      const WarmupStation &a = state.stations[j];
+      const WarmupStation &b = cold[j];
+
+      associatedFast += a.associated;
+      associatedCold += b.associated;
+      associationMismatch += a.associated != b.associated;
+      queuedFast += a.queuePackets;
+      queuedCold += b.queuePackets;
+      bitsFast += a.warmupBits;
+      bitsCold += b.warmupBits;
+      maxPositionDiff = std::max (maxPositionDiff, std::hypot (a.x - b.x, a.y - b.y));
     }
+
+  std::cout << "[t=" << Simulator::Now ().GetSeconds () << "s] Warmup state vs cold run:" << std::endl
+            << "- warmup wall time: " << state.wallTime << " s (cold " << g_warmupSnapshot.wallTime << " s)"
+            << std::endl
+            << "- associated stations: " << associatedFast << "/" << n << " (cold " << associatedCold
+            << ", mismatched " << associationMismatch << ")" << std::endl
+            << "- max position difference: " << maxPositionDiff << " m" << std::endl
+            << "- queued packets: " << queuedFast << " (cold " << queuedCold << ")" << std::endl
+            << "- warmup traffic received: " << bitsFast / 1e6 << " Mb (cold " << bitsCold / 1e6 << " Mb)"
+            << std::endl;
 }
 
 void
-InstallTrafficGenerator (Ptr<ns3::Node> fromNode, Ptr<ns3::Node> toNode, uint32_t port,
-                         DataRate offeredLoad, uint32_t packetSize, double startTime, double stopTime)
+InstallTrafficGenerator (Ptr<ns3::Node> fromNode, Ptr<ns3::Node> toNode, uint32_t port, DataRate warmupLoad,
+                         DataRate offeredLoad, uint32_t packetSize, double stopTime)
 {
   // Get sink address
   Ptr<Ipv4> ipv4 = toNode->GetObject<Ipv4> ();
@@ -696,31 +2181,22 @@ InstallTrafficGenerator (Ptr<ns3::Node> fromNode, Ptr<ns3::Node> toNode, uint32_
   uint8_t tosValue = 0x70; //AC_BE
 
   // Add random fuzz to app start time
-  if (startTime == 0.)
-    {
-      Ptr<UniformRandomVariable> fuzz = CreateObject<UniformRandomVariable> ();
-      fuzz->SetAttribute ("Min", DoubleValue (0.));
-      fuzz->SetAttribute ("Max", DoubleValue (fuzzTime));
-      fuzz->SetStream (0);
-      startTime += fuzz->GetValue ();
-    }
+  Ptr<UniformRandomVariable> fuzz = CreateObject<UniformRandomVariable> ();
+  fuzz->SetAttribute ("Min", DoubleValue (0.));
+  fuzz->SetAttribute ("Max", DoubleValue (fuzzTime));
+  fuzz->SetStream (0);
+  double startTime = fuzz->GetValue ();
 
-  // Configure source and sink
+  // Configure source, the sink is shared by all stations
   InetSocketAddress sinkSocket (addr, port);
   sinkSocket.SetTos (tosValue);
-  PacketSinkHelper packetSinkHelper ("ns3::UdpSocketFactory", sinkSocket);
-
-  OnOffHelper onOffHelper ("ns3::UdpSocketFactory", sinkSocket);
-  onOffHelper.SetConstantRate (offeredLoad, packetSize);
 
-  // Configure applications
-  ApplicationContainer sinkApplications (packetSinkHelper.Install (toNode));
-  ApplicationContainer sourceApplications (onOffHelper.Install (fromNode));
+  Ptr<StaTrafficApplication> source = CreateObject<StaTrafficApplication> ();
+  source->Setup (sinkSocket, packetSize, warmupLoad, offeredLoad, Seconds (warmupTime));
+  fromNode->AddApplication (source);
 
-  sinkApplications.Start (Seconds (startTime));
-  sinkApplications.Stop (Seconds (stopTime));
-  sourceApplications.Start (Seconds (startTime));
-  sourceApplications.Stop (Seconds (stopTime));
+  source->SetStartTime (Seconds (startTime));
+  source->SetStopTime (Seconds (stopTime));
 }
 
 void
@@ -728,6 +2204,8 @@ LogSuccessRate ()
 {
     static uint64_t lastReqSent = 0;
     static uint64_t lastReqRec = 0;
+    static std::vector<uint64_t> lastApReqSent (apFtmReqSent.size (), 0);
+    static std::vector<uint64_t> lastApReqRec (apFtmReqRec.size (), 0);
 
     uint64_t reqSent = ftmReqSent - lastReqSent;
     uint64_t reqRec = ftmReqRec - lastReqRec;
@@ -735,27 +2213,37 @@ LogSuccessRate ()
     lastReqSent = ftmReqSent;
     lastReqRec = ftmReqRec;
 
-    logOutput << Simulator::Now ().GetSeconds () - warmupTime << "," << successRate << std::endl;
+    logOutput << Simulator::Now ().GetSeconds () - warmupTime << "," << successRate;
+
+    for (uint32_t k = 0; apFtmReqSent.size () > 1 && k < apFtmReqSent.size (); ++k)
+      {
+        logOutput << "," << (apFtmReqRec[k] - lastApReqRec[k]) / (double) (apFtmReqSent[k] - lastApReqSent[k]);
+        lastApReqSent[k] = apFtmReqSent[k];
+        lastApReqRec[k] = apFtmReqRec[k];
+      }
+
+    logOutput << std::endl;
     Simulator::Schedule (Seconds (logInterval), &LogSuccessRate);
 }
 
 void
 PopulateArpCache ()
 {
+  // One neighbor table shared by all interfaces, filled and installed in a single pass
   Ptr<ArpCache> arp = CreateObject<ArpCache> ();
   arp->SetAliveTimeout (Seconds (3600 * 24));
 
+  // Entries only pass through WAIT_REPLY on their way to ALIVE, so they can share one packet
+  Ptr<Packet> p = Create<Packet> (100);
+
   for (auto i = NodeList::Begin (); i != NodeList::End (); ++i)
     {
       Ptr<Ipv4L3Protocol> ip = (*i)->GetObject<Ipv4L3Protocol> ();
-      ObjectVectorValue interfaces;
-      ip->GetAttribute ("InterfaceList", interfaces);
 
-      for (auto j = interfaces.Begin (); j != interfaces.End (); j++)
+      for (uint32_t j = 0; j < ip->GetNInterfaces (); j++)
         {
-          Ptr<Ipv4Interface> ipIface = (*j).second->GetObject<Ipv4Interface> ();
-          Ptr<NetDevice> device = ipIface->GetDevice ();
-          Mac48Address addr = Mac48Address::ConvertFrom (device->GetAddress ());
+          Ptr<Ipv4Interface> ipIface = ip->GetInterface (j);
+          Address addr = ipIface->GetDevice ()->GetAddress ();
 
           for (uint32_t k = 0; k < ipIface->GetNAddresses (); k++)
             {
@@ -769,31 +2257,134 @@ PopulateArpCache ()
               Ipv4Header ipv4Hdr;
               ipv4Hdr.SetDestination (ipAddr);
 
-              Ptr<Packet> p = Create<Packet> (100);
               entry->MarkWaitReply (ArpCache::Ipv4PayloadHeaderPair (p, ipv4Hdr));
               entry->MarkAlive (addr);
             }
+
+          ipIface->SetArpCache (arp);
         }
     }
+}
 
-  for (auto i = NodeList::Begin (); i != NodeList::End (); ++i)
+void
+SetPosition (Ptr<MobilityModel> mobilityModel, Vector3D pos)
+{
+  mobilityModel->SetPosition (pos);
+}
+
+std::vector<Vector>
+InstallRandomWaypoint (NodeContainer stations, double area, double nodeSpeed, double nodePause)
+{
+  MobilityHelper mobility;
+
+  // Place nodes randomly in square extending from (0, 0) to (area, area)
+  ObjectFactory pos;
+  pos.SetTypeId ("ns3::RandomRectanglePositionAllocator");
+  std::stringstream ssArea;
+  ssArea << "ns3::UniformRandomVariable[Min=0.0|Max=" << area;
+  pos.Set ("X", StringValue (ssArea.str () + "|Stream=2]"));
+  pos.Set ("Y", StringValue (ssArea.str () + "|Stream=3]"));
+
+  Ptr<PositionAllocator> taPositionAlloc = pos.Create ()->GetObject<PositionAllocator> ();
+  mobility.SetPositionAllocator (taPositionAlloc);
+
+  // Set random pause (from 0 to nodePause [s]) and speed (from 0 to nodeSpeed [m/s])
+  std::stringstream ssSpeed;
+  ssSpeed << "ns3::UniformRandomVariable[Min=0.0|Max=" << nodeSpeed << "|Stream=4]";
+  std::stringstream ssPause;
+  ssPause << "ns3::UniformRandomVariable[Min=0.0|Max=" << nodePause << "|Stream=5]";
+
+  mobility.SetMobilityModel ("ns3::RandomWaypointMobilityModel",
+                             "Speed", StringValue (ssSpeed.str ()),
+                             "Pause", StringValue (ssPause.str ()),
+                             "PositionAllocator", PointerValue (taPositionAlloc));
+
+  mobility.Install (stations);
+
+  // Positions drawn by the allocator, static stations return there at fuzzTime
+  std::vector<Vector> drawn;
+
+  for (uint32_t j = 0; j < stations.GetN (); ++j)
     {
-      Ptr<Ipv4L3Protocol> ip = (*i)->GetObject<Ipv4L3Protocol> ();
-      ObjectVectorValue interfaces;
-      ip->GetAttribute ("InterfaceList", interfaces);
+      Ptr<MobilityModel> mobilityModel = stations.Get (j)->GetObject<MobilityModel> ();
+      drawn.push_back (mobilityModel->GetPosition ());
 
-      for (auto j = interfaces.Begin (); j != interfaces.End (); j++)
+      if (nodeSpeed == 0.)
         {
-          Ptr<Ipv4Interface> ipIface = (*j).second->GetObject<Ipv4Interface> ();
-          ipIface->SetAttribute ("ArpCache", PointerValue (arp));
+          Simulator::Schedule (Seconds (fuzzTime), &SetPosition, mobilityModel, mobilityModel->GetPosition ());
         }
+
+      mobilityModel->SetPosition (Vector3D (0., 0., 0.));
     }
+
+  return drawn;
 }
 
 void
-SetPosition (Ptr<MobilityModel> mobilityModel, Vector3D pos)
+RecordCourseChange (TraceRecorder *recorder, Ptr<const MobilityModel> model)
 {
-  mobilityModel->SetPosition (pos);
+  double now = Simulator::Now ().GetSeconds ();
+  Vector pos = model->GetPosition ();
+
+  // A jump (SetPosition) needs the position reached just before it, otherwise
+  // the playback would glide from the previous sample
+  if (!recorder->samples.empty ())
+    {
+      const TraceSample &last = recorder->samples.back ();
+      double dt = now - last.time;
+      Vector reached (last.x + recorder->velocity.x * dt, last.y + recorder->velocity.y * dt,
+                      last.z + recorder->velocity.z * dt);
+
+      if (CalculateDistance (reached, pos) > 1e-3)
+        {
+          recorder->samples.push_back ({now, (float) reached.x, (float) reached.y, (float) reached.z});
+        }
+    }
+
+  recorder->samples.push_back ({now, (float) pos.x, (float) pos.y, (float) pos.z});
+  recorder->velocity = model->GetVelocity ();
+}
+
+bool
+ExportMobilityTrace (const std::string &path, uint32_t nWifi, double area, double nodeSpeed, double nodePause)
+{
+  // Stations move between course changes along straight lines, so recording
+  // every course change and the final positions captures the whole run
+  NodeContainer stations (nWifi);
+  InstallRandomWaypoint (stations, area, nodeSpeed, nodePause);
+
+  std::vector<TraceRecorder> recorders (nWifi);
+  for (uint32_t j = 0; j < nWifi; ++j)
+    {
+      Ptr<MobilityModel> model = stations.Get (j)->GetObject<MobilityModel> ();
+      RecordCourseChange (&recorders[j], model);
+      model->TraceConnectWithoutContext ("CourseChange", MakeBoundCallback (&RecordCourseChange, &recorders[j]));
+    }
+
+  double duration = warmupTime + simulationTime;
+  Simulator::Stop (Seconds (duration));
+  Simulator::Run ();
+
+  std::vector<std::vector<TraceSample>> samples (nWifi);
+  uint64_t nSamples = 0;
+  for (uint32_t j = 0; j < nWifi; ++j)
+    {
+      RecordCourseChange (&recorders[j], stations.Get (j)->GetObject<MobilityModel> ());
+      samples[j].swap (recorders[j].samples);
+      nSamples += samples[j].size ();
+    }
+
+  Simulator::Destroy ();
+
+  if (!MobilityTrace::Write (path, samples, duration, nodeSpeed))
+    {
+      std::cerr << "Cannot write mobility trace: " << path << "!";
+      return false;
+    }
+
+  std::cout << "Mobility trace of " << nWifi << " stations (" << nSamples << " samples, " << duration
+            << " s) saved to: " << path << std::endl;
+  return true;
 }
 
 void
@@ -804,8 +2395,23 @@ SetFtmParams (FtmParams ftmParams)
   Config::SetDefault ("ns3::FtmSession::DefaultFtmParams", PointerValue (ftmParamsHolder));
 }
 
+FtmParams
+ToFtmParams (const ApAct &act)
+{
+  FtmParams p;
+  p.SetNumberOfBurstsExponent(act.ftmNumberOfBurstsExponent);
+  p.SetBurstDuration(act.ftmBurstDuration);
+  p.SetMinDeltaFtm(act.ftmMinDeltaFtm);
+  p.SetPartialTsfTimer(act.ftmPartialTsfTimer);
+  p.SetPartialTsfNoPref(act.ftmPartialTsfNoPref);
+  p.SetAsap(act.ftmAsap);
+  p.SetFtmsPerBurst(act.ftmFtmsPerBurst);
+  p.SetBurstPeriod(act.ftmBurstPeriod);
+  return p;
+}
+
 void
-FtmBurst (uint32_t staId, Ptr<WifiNetDevice> device, Mac48Address apAddress)
+FtmBurst (uint32_t staId, Ptr<WifiNetDevice> device, uint32_t apId, Mac48Address apAddress)
 {
   Ptr<RegularWifiMac> staMac = device->GetMac ()->GetObject<RegularWifiMac> ();
   Ptr<FtmSession> session = staMac->NewFtmSession (apAddress);
@@ -815,32 +2421,36 @@ FtmBurst (uint32_t staId, Ptr<WifiNetDevice> device, Mac48Address apAddress)
       Ptr<WirelessSigStrFtmErrorModel> errorModel = CreateObject<WirelessSigStrFtmErrorModel> (RngSeedManager::GetRun ());
       errorModel->SetNode (device->GetNode ());
 
+      // Request the parameters chosen for the responder AP
+      session->SetFtmParams (g_apFtmParams[apId]);
       session->SetFtmErrorModel (errorModel);
-      session->SetSessionOverCallback (MakeCallback (&FtmSessionOver));
+      session->SetSessionOverCallback (MakeBoundCallback (&FtmSessionOver, apId));
       session->SessionBegin ();
 
       ftmReqSent++;
+      apFtmReqSent[apId]++;
     }
 
-  Simulator::Schedule (Seconds (ftmIntervalTime), &FtmBurst, staId, device, apAddress);
+  Simulator::Schedule (Seconds (ftmIntervalTime), &FtmBurst, staId, device, apId, apAddress);
 }
 
 
 void 
-FtmSessionOver (FtmSession session)
+FtmSessionOver (uint32_t apId, FtmSession session)
 {
-  g_sessionsTotal++;
+  g_sessionsTotal[apId]++;
 
   double distance = session.GetMeanRTT () * RTT_TO_DISTANCE;
   if (distance != 0 && distance < MAX_DISTANCE)
   {
     ftmReqRec++;
-    g_sessionsOk++;
+    apFtmReqRec[apId]++;
+    g_sessionsOk[apId]++;
   }
 
-  // zmiana co N sesji (łącznie)
+  // zmiana co N sesji na AP (łącznie), jedna wymiana dla wszystkich AP
   g_sessionsSinceChange++;
-  if (g_sessionsSinceChange >= g_changeEvery)
+  if (g_sessionsSinceChange >= g_changeEvery * g_sessionsTotal.size())
   {
     g_sessionsSinceChange = 0;
     ApplyFtmFromPython();
@@ -848,62 +2458,463 @@ FtmSessionOver (FtmSession session)
 }
 
 
-static void ApplyFtmFromPython()
+static uint8_t Bucket(double value, const double *edges, uint8_t nBuckets)
 {
-  if (!g_ftmCtrl) return;
+  uint8_t bucket = 0;
+  while (bucket < nBuckets - 1 && value >= edges[bucket])
+    bucket++;
+  return bucket;
+}
 
-  Env env{};    
-  env.attempts = g_sessionsTotal;
-  env.successes = g_sessionsOk;                     
-  Act act = g_ftmCtrl->GetFTMParams(env);
+static Env BuildEnv()
+{
+  Env env{};
+  env.nAp = g_sessionsTotal.size();
 
-  if (!act.apply) return;
+  // kontekst segmentu: obciążenie, moc stacji i ich odległość od AP
+  std::vector<uint32_t> highPower(env.nAp, 0);
+  std::vector<double> distanceSum(env.nAp, 0.);
+  for (uint32_t j = 0; j < g_staAp.size(); ++j)
+  {
+    uint32_t k = g_staAp[j];
+    highPower[k] += g_staHighPower[j];
+    distanceSum[k] += g_staMobility[j]->GetDistanceFrom(g_apMobility[k]);
+  }
 
-  FtmParams p;
-  p.SetNumberOfBurstsExponent(act.ftmNumberOfBurstsExponent);
-  p.SetBurstDuration(act.ftmBurstDuration);
-  p.SetMinDeltaFtm(act.ftmMinDeltaFtm);
-  p.SetPartialTsfTimer(act.ftmPartialTsfTimer);
-  p.SetPartialTsfNoPref(act.ftmPartialTsfNoPref);
-  p.SetAsap(act.ftmAsap);
-  p.SetFtmsPerBurst(act.ftmFtmsPerBurst);
-  p.SetBurstPeriod(act.ftmBurstPeriod);
+  for (uint32_t k = 0; k < env.nAp; ++k)
+  {
+    ApEnv &slot = env.ap[k];
+    slot.ftmNumberOfBurstsExponent = g_apParams[k].ftmNumberOfBurstsExponent;
+    slot.ftmBurstDuration          = g_apParams[k].ftmBurstDuration;
+    slot.ftmMinDeltaFtm            = g_apParams[k].ftmMinDeltaFtm;
+    slot.ftmPartialTsfTimer        = g_apParams[k].ftmPartialTsfTimer;
+    slot.ftmPartialTsfNoPref       = g_apParams[k].ftmPartialTsfNoPref;
+    slot.ftmAsap                   = g_apParams[k].ftmAsap;
+    slot.ftmFtmsPerBurst           = g_apParams[k].ftmFtmsPerBurst;
+    slot.ftmBurstPeriod            = g_apParams[k].ftmBurstPeriod;
+    slot.attempts  = g_sessionsTotal[k];
+    slot.successes = g_sessionsOk[k];
+    slot.nWifi     = g_apStations[k];
+    slot.dataRate  = g_apDataRate[k];
+
+    double elapsed = (Simulator::Now() - g_segmentStart[k]).GetSeconds();
+    double load = elapsed > 0
+                    ? 8. * (g_apSinks[k]->GetTotalRxBytes() - g_segmentRxBytes[k]) / (1e6 * elapsed)
+                    : 0.;
+    double meanDistance = g_apStations[k] > 0 ? distanceSum[k] / g_apStations[k] : 0.;
+
+    slot.loadBucket     = Bucket(load, g_loadEdges, N_LOAD_BUCKETS);
+    slot.powerState     = highPower[k] == 0 ? 0 : (highPower[k] < g_apStations[k] ? 1 : 2);
+    slot.distanceBucket = Bucket(meanDistance, g_distanceEdges, N_DISTANCE_BUCKETS);
+    slot.context = (slot.loadBucket * N_POWER_STATES + slot.powerState) * N_DISTANCE_BUCKETS
+                   + slot.distanceBucket;
+  }
 
-  SetFtmParams(p);
-  
-  g_sessionsTotal = 0;
-  g_sessionsOk    = 0;
-  
-
-  std::cout << "[t=" << Simulator::Now().GetSeconds() << "s] APPLIED FTM: "
-            << "BDur="    << int(act.ftmBurstDuration)
-            << " MinΔ="   << int(act.ftmMinDeltaFtm)
-            << " PerBurst=" << int(act.ftmFtmsPerBurst)
-            << " Period=" << act.ftmBurstPeriod
-            << " ASAP="   << act.ftmAsap
-            << std::endl;
+  return env;
+}
+
+
+static void ApplyFtmFromPython()
+{
+  if (!g_ftmCtrl) return;
+
+  Env env = BuildEnv();
+  auto exchangeStart = std::chrono::steady_clock::now();
+  Act result = g_ftmCtrl->GetFTMParams(env);
+  std::chrono::duration<double, std::milli> latency = std::chrono::steady_clock::now() - exchangeStart;
+  if (g_agentLatency.size() < g_agentLatencyWindow)
+    g_agentLatency.push_back(latency.count());
+  else
+    g_agentLatency[g_agentExchanges % g_agentLatencyWindow] = latency.count();
+  g_agentExchanges++;
+  g_agentLatencySum += latency.count();
+  g_agentLatencyMax = std::max(g_agentLatencyMax, latency.count());
+  g_agentLatencyLast = latency.count();
+
+  // agent wysyła długość segmentu tylko po zmianie (PBT), polecenie z gniazda ma pierwszeństwo
+  if (result.changeEvery > 0 && result.changeEvery != g_changeEvery)
+  {
+    if (g_changeEveryPinned)
+    {
+      std::cout << "[t=" << Simulator::Now().GetSeconds() << "s] Segment length "
+                << result.changeEvery << " from the agent ignored, set by the control socket" << std::endl;
+    }
+    else
+    {
+      g_changeEvery = result.changeEvery;
+      std::cout << "[t=" << Simulator::Now().GetSeconds() << "s] Segment length: "
+                << g_changeEvery << " sessions per AP" << std::endl;
+    }
+  }
+
+  for (uint32_t k = 0; k < env.nAp; ++k)
+  {
+    const ApAct &act = result.ap[k];
+    if (!act.apply) continue;
+
+    g_apParams[k] = act;
+    g_apFtmParams[k] = ToFtmParams(act);
+
+    g_sessionsTotal[k] = 0;
+    g_sessionsOk[k]    = 0;
+    g_segmentStart[k]  = Simulator::Now();
+    g_segmentRxBytes[k] = g_apSinks[k]->GetTotalRxBytes();
+
+    std::cout << "[t=" << Simulator::Now().GetSeconds() << "s] APPLIED FTM: "
+              << "AP="      << k
+              << " BDur="   << int(act.ftmBurstDuration)
+              << " MinΔ="   << int(act.ftmMinDeltaFtm)
+              << " PerBurst=" << int(act.ftmFtmsPerBurst)
+              << " Period=" << act.ftmBurstPeriod
+              << " ASAP="   << act.ftmAsap
+              << std::endl;
+  }
 }
 
 static void FinalFlushToPython()
 {
   if (!g_ftmCtrl) return;
 
-  if (g_sessionsSinceChange == 0 && g_sessionsTotal == 0)
-    return;
+  Env env = BuildEnv();
 
-  Env env{};
-  env.attempts  = g_sessionsTotal;
-  env.successes = g_sessionsOk;
+  uint32_t attempts = 0;
+  uint32_t successes = 0;
+  for (uint32_t k = 0; k < env.nAp; ++k)
+  {
+    attempts  += env.ap[k].attempts;
+    successes += env.ap[k].successes;
+  }
+
+  if (g_sessionsSinceChange == 0 && attempts == 0)
+    return;
 
   (void) g_ftmCtrl->GetFTMParams(env);
 
-  double rate = (env.attempts > 0)
-                  ? static_cast<double>(env.successes) / env.attempts
+  double rate = (attempts > 0)
+                  ? static_cast<double>(successes) / attempts
                   : 0.0;
 
   std::cout << "[t=" << Simulator::Now().GetSeconds()
-            << "s] Final flush: attempts=" << env.attempts
-            << " successes=" << env.successes
+            << "s] Final flush: attempts=" << attempts
+            << " successes=" << successes
             << " rate=" << rate
             << std::endl;
 }
+
+static std::string ControlCommand(const std::string &command)
+{
+  std::istringstream in(command);
+  std::string name;
+  in >> name;
+
+  if (name == "status")
+    return ControlStatus();
+
+  if (name == "flush")
+    return FlushPartialResults();
+
+  if (name == "set")
+  {
+    std::string key;
+    double value = 0.;
+    in >> key >> value;
+
+    if (!in || value <= 0.)
+      return "{\"error\":\"usage: set changeEvery|logInterval <positive value>\"}";
+
+    std::ostringstream reply;
+    if (key == "changeEvery")
+    {
+      // FtmSessionOver mnoży przez liczbę AP, iloczyn musi się zmieścić w uint32_t
+      const uint32_t maxChangeEvery = UINT32_MAX / MAX_AP_SLOTS;
+      if (value > maxChangeEvery)
+        return "{\"error\":\"usage: set changeEvery <1.." + std::to_string(maxChangeEvery) + ">\"}";
+
+      g_changeEvery = std::max<long>(1, std::lround(value));
+      g_changeEveryPinned = true;
+      reply << "{\"ok\":true,\"changeEvery\":" << g_changeEvery << "}";
+    }
+    else if (key == "logInterval")
+    {
+      // obowiązuje od następnego wpisu w logu
+      logInterval = value;
+      reply << "{\"ok\":true,\"logInterval\":" << logInterval << "}";
+    }
+    else
+      return "{\"error\":\"unknown setting: " + key + "\"}";
+
+    g_controlSteered = true;
+    std::cout << "[t=" << Simulator::Now().GetSeconds() << "s] Control socket: " << command << std::endl;
+    return reply.str();
+  }
+
+  return "{\"error\":\"unknown command, use status, flush or set\"}";
+}
+
+static std::string ControlStatus()
+{
+  // tempo symulacji od startu i od poprzedniego zapytania
+  static uint64_t lastEvents = 0;
+  static std::chrono::steady_clock::time_point lastQuery = g_runStart;
+
+  auto now = std::chrono::steady_clock::now();
+  uint64_t events = Simulator::GetEventCount();
+  std::chrono::duration<double> sinceStart = now - g_runStart;
+  std::chrono::duration<double> sinceLast = now - lastQuery;
+  double recentRate = sinceLast.count() > 0. ? (events - lastEvents) / sinceLast.count() : 0.;
+  lastEvents = events;
+  lastQuery = now;
+
+  std::ostringstream out;
+  out << "{\"time\":" << Simulator::Now().GetSeconds()
+      << ",\"stopTime\":" << warmupTime + simulationTime
+      << ",\"wallTime\":" << sinceStart.count()
+      << ",\"events\":" << events
+      << ",\"eventsPerSec\":" << (sinceStart.count() > 0. ? events / sinceStart.count() : 0.)
+      << ",\"recentEventsPerSec\":" << recentRate
+      << ",\"changeEvery\":" << g_changeEvery
+      << ",\"changeEveryPinned\":" << (g_changeEveryPinned ? "true" : "false")
+      << ",\"sessionsSinceChange\":" << g_sessionsSinceChange
+      << ",\"logInterval\":" << logInterval
+      << ",\"ftmSent\":" << ftmReqSent
+      << ",\"ftmReceived\":" << ftmReqRec
+      << ",\"ap\":[";
+
+  for (uint32_t k = 0; k < g_apParams.size(); ++k)
+  {
+    const ApAct &act = g_apParams[k];
+    out << (k ? "," : "")
+        << "{\"stations\":" << g_apStations[k]
+        << ",\"sessionsTotal\":" << g_sessionsTotal[k]
+        << ",\"sessionsOk\":" << g_sessionsOk[k]
+        << ",\"ftmSent\":" << apFtmReqSent[k]
+        << ",\"ftmReceived\":" << apFtmReqRec[k]
+        << ",\"params\":{\"numberOfBurstsExponent\":" << int(act.ftmNumberOfBurstsExponent)
+        << ",\"burstDuration\":" << int(act.ftmBurstDuration)
+        << ",\"minDeltaFtm\":" << int(act.ftmMinDeltaFtm)
+        << ",\"partialTsfTimer\":" << act.ftmPartialTsfTimer
+        << ",\"partialTsfNoPref\":" << (act.ftmPartialTsfNoPref ? "true" : "false")
+        << ",\"asap\":" << (act.ftmAsap ? "true" : "false")
+        << ",\"ftmsPerBurst\":" << int(act.ftmFtmsPerBurst)
+        << ",\"burstPeriod\":" << act.ftmBurstPeriod << "}}";
+  }
+
+  // percentyle z ostatnich wymian, kopia ma najwyżej g_agentLatencyWindow elementów
+  std::vector<double> latency = g_agentLatency;
+  std::sort(latency.begin(), latency.end());
+
+  out << "],\"agent\":{\"exchanges\":" << g_agentExchanges;
+  if (!latency.empty())
+  {
+    out << ",\"meanMs\":" << g_agentLatencySum / g_agentExchanges
+        << ",\"windowExchanges\":" << latency.size()
+        << ",\"p50Ms\":" << latency[latency.size() / 2]
+        << ",\"p99Ms\":" << latency[std::min(latency.size() - 1, latency.size() * 99 / 100)]
+        << ",\"maxMs\":" << g_agentLatencyMax
+        << ",\"lastMs\":" << g_agentLatencyLast;
+  }
+  out << "}}";
+
+  return out.str();
+}
+
+static std::string FlushPartialResults()
+{
+  double measured = Simulator::Now().GetSeconds() - warmupTime;
+  if (measured <= 0.)
+    return "{\"error\":\"warmup in progress\"}";
+
+  double throughput = 0.;
+  for (uint32_t j = 0; j < g_staAp.size(); ++j)
+    throughput += (8. * g_apSinks[g_staAp[j]]->GetRxBytes(j) - warmupFlows[j]) / (1e6 * measured);
+
+  double ftmSuccessRate = ftmReqRec / (double) ftmReqSent;
+
+  // zapis przez plik tymczasowy - czytający nigdy nie widzi połowy wyników
+  std::string partialPath = g_csvPath + ".partial";
+  {
+    std::ofstream csv(partialPath + ".tmp");
+    csv << "time,throughput,ftmSuccessRate" << std::endl
+        << measured << ',' << throughput << ',' << ftmSuccessRate << std::endl;
+  }
+  {
+    std::ofstream log(g_logPath + ".tmp");
+    log << logOutput.str();
+  }
+  std::rename((partialPath + ".tmp").c_str(), partialPath.c_str());
+  std::rename((g_logPath + ".tmp").c_str(), g_logPath.c_str());
+
+  std::ostringstream reply;
+  reply << "{\"ok\":true,\"time\":" << measured << ",\"throughput\":" << throughput
+        << ",\"ftmSuccessRate\":" << ftmSuccessRate << ",\"csv\":\"" << partialPath
+        << "\",\"log\":\"" << g_logPath << "\"}";
+  return reply.str();
+}
+
+std::string
+BuildIdentity ()
+{
+  // Hash of the running binary and of the ns-3 libraries mapped into it, the
+  // scenario alone does not change when only a module is rebuilt. Falls back
+  // to the compilation time.
+  std::ifstream binary ("/proc/self/exe", std::ios::binary);
+  if (!binary)
+    {
+      return __DATE__ " " __TIME__;
+    }
+
+  uint64_t hash = HashFile ("/proc/self/exe", 14695981039346656037ULL);
+
+  // Every library is mapped several times (code, data), hash each once in map order
+  std::ifstream maps ("/proc/self/maps");
+  std::vector<std::string> libraries;
+  std::string line;
+
+  while (std::getline (maps, line))
+    {
+      std::string::size_type path = line.find ('/');
+      if (path == std::string::npos)
+        {
+          continue;
+        }
+
+      std::string library = line.substr (path);
+      std::string name = library.substr (library.rfind ('/') + 1);
+
+      if (name.compare (0, 6, "libns3") == 0
+          && std::find (libraries.begin (), libraries.end (), library) == libraries.end ())
+        {
+          libraries.push_back (library);
+          hash = HashString (name, hash);
+          hash = HashFile (library, hash);
+        }
+    }
+
+  std::ostringstream identity;
+  identity << std::hex << hash;
+  return identity.str ();
+}
+
+std::string
+AttributeOverrides (int argc, char *argv[])
+{
+  // Arguments handled by CommandLine itself rather than by the scenario
+  // options: attribute defaults (--ns3::Type::Attribute=value) and global
+  // values (--RngRun=1). Shared memory keys only select the agent.
+  std::string overrides;
+
+  for (int i = 1; i < argc; ++i)
+    {
+      std::string argument = argv[i];
+      if (argument.compare (0, 2, "--") != 0)
+        {
+          continue;
+        }
+
+      std::string name = argument.substr (2, argument.find ('=') - 2);
+      bool keep = name.find ("::") != std::string::npos;
+
+      for (auto value = GlobalValue::Begin (); !keep && value != GlobalValue::End (); ++value)
+        {
+          keep = (*value)->GetName () == name && name != "SharedMemoryKey" && name != "SharedMemoryPoolSize";
+        }
+
+      if (keep)
+        {
+          overrides += argument + " ";
+        }
+    }
+
+  return overrides;
+}
+
+uint64_t
+HashString (const std::string &data, uint64_t hash)
+{
+  return HashBytes (data.data (), data.size (), hash);
+}
+
+uint64_t
+HashBytes (const char *data, size_t size, uint64_t hash)
+{
+  // 64-bit FNV-1a, stable across platforms and builds
+  for (size_t i = 0; i < size; ++i)
+    {
+      hash ^= (unsigned char) data[i];
+      hash *= 1099511628211ULL;
+    }
+
+  return hash;
+}
+
+uint64_t
+HashFile (const std::string &path, uint64_t hash)
+{
+  std::ifstream file (path, std::ios::binary);
+  char buffer[65536];
+
+  while (file.read (buffer, sizeof (buffer)) || file.gcount () > 0)
+    {
+      hash = HashBytes (buffer, file.gcount (), hash);
+    }
+
+  return hash;
+}
+
+bool
+LoadCachedResults (const std::string &entryDir, const std::string &csvPath, const std::string &logPath,
+                   std::string &csvLine)
+{
+  std::ifstream cachedCsv (entryDir + "/results.csv");
+  std::ifstream cachedLog (entryDir + "/log.csv");
+
+  if (!cachedCsv || !cachedLog)
+    {
+      return false;
+    }
+
+  std::ostringstream csv;
+  csv << cachedCsv.rdbuf ();
+  csvLine = csv.str ();
+
+  if (!csvLine.empty () && csvLine.back () == '\n')
+    {
+      csvLine.pop_back ();
+    }
+
+  std::ofstream outputFile (csvPath);
+  outputFile << csv.str ();
+
+  std::ofstream logFile (logPath);
+  logFile << cachedLog.rdbuf ();
+
+  return true;
+}
+
+void
+StoreCachedResults (const std::string &cacheDir, const std::string &key, const std::string &csvLine,
+                    const std::string &log)
+{
+  // Write to a private directory and rename it, so readers never see partial entries
+  std::string entryDir = cacheDir + "/" + key;
+  std::string tmpDir = entryDir + ".tmp." + std::to_string (getpid ());
+  ns3::SystemPath::MakeDirectories (tmpDir);
+
+  {
+    std::ofstream csvFile (tmpDir + "/results.csv");
+    csvFile << csvLine;
+    std::ofstream logFile (tmpDir + "/log.csv");
+    logFile << log;
+  }
+
+  if (std::rename (tmpDir.c_str (), entryDir.c_str ()) != 0)
+    {
+      // Another run stored the same entry first
+      std::remove ((tmpDir + "/results.csv").c_str ());
+      std::remove ((tmpDir + "/log.csv").c_str ());
+      std::remove (tmpDir.c_str ());
+      return;
+    }
+
+  std::cout << "Results stored in cache: " << entryDir << std::endl;
+}